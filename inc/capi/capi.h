@@ -31,6 +31,41 @@
 #define CAPI_CACHELINE_BYTES    128
 #define CAPI_TIMER_FREQ         250000000
 
+// Allocations smaller than this don't use 1 GB pages, which would
+// otherwise pin a whole page to hold a few megabytes
+#define CAPI_HUGE_1G_MIN_BYTES  (512UL << 20)
+
+// Page backing for capi_alloc_pages, from least to most preferred. The
+// backing asked for is an upper bound: allocation falls back through the
+// smaller sizes down to normal pages.
+enum capi_backing {
+    CAPI_BACKING_NORMAL,
+    CAPI_BACKING_THP,
+    CAPI_BACKING_HUGE_2M,
+    CAPI_BACKING_HUGE_1G,
+};
+
+struct capi_mem {
+    void *addr;
+    size_t len;
+    enum capi_backing backing;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void *capi_alloc(size_t size);
 
+int capi_alloc_pages(struct capi_mem *mem, size_t size,
+                     enum capi_backing backing);
+int capi_alloc_pages_node(struct capi_mem *mem, size_t size,
+                          enum capi_backing backing, int node);
+void capi_free_pages(struct capi_mem *mem);
+const char *capi_backing_name(enum capi_backing backing);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,50 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     CRC32C (Castagnoli) checksums
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_CRC32C_H
+#define LIBCAPI_CRC32C_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Extend crc over buf. Start with 0; the usual pre and post inversion
+// is done internally so results chain across calls.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// The crc of A followed by B, given crc1 of A and crc2 of B which is
+// len2 bytes long
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+// Name of the implementation picked for this CPU
+const char *crc32c_impl(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Closed loop tuning of the AFU's command credits (croom)
+//
+//     A background thread hill-climbs croom while traffic runs, scoring
+//     each setting by the bytes per second implied by the AFU's read
+//     and write cache line counters, then holds the best one found.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_CROOM_TUNER_H
+#define LIBCAPI_CROOM_TUNER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct wqueue;
+struct croom_tuner;
+
+struct croom_tuner_opts {
+    int min_croom, max_croom;
+    int start_croom;
+    int step;               // initial step, halved until it reaches 1
+    unsigned settle_ms;     // ignored traffic after each change
+    unsigned interval_ms;   // length of each measurement
+    double min_gain;        // relative improvement needed to move
+    int use_snooper;        // also sample the snooper tag counters
+};
+
+struct croom_sample {
+    int croom;
+    double bytes_per_sec;
+    double tag_usage;       // snooper tag_count / acc_count, or 0
+    double tag_avg;         // snooper average tag time, or 0
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void croom_tuner_default_opts(struct croom_tuner_opts *opts);
+
+struct croom_tuner *croom_tuner_start(struct wqueue *wq,
+                                      const struct croom_tuner_opts *opts);
+void croom_tuner_stop(struct croom_tuner *t);
+
+int croom_tuner_done(struct croom_tuner *t);
+int croom_tuner_best(struct croom_tuner *t);
+
+// Copy out the settings measured so far in the order they were tried
+size_t croom_tuner_curve(struct croom_tuner *t, struct croom_sample *out,
+                         size_t max);
+void croom_tuner_print(struct croom_tuner *t, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
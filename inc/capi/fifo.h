@@ -30,15 +30,65 @@
 #define LIBCAPI_FIFO_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
 
 struct fifo;
 
+// Occupancy histogram buckets: the first is time spent empty, the last
+// time spent full and the rest split the levels in between evenly
+#define FIFO_OCCUPANCY_BUCKETS 10
+
+// Running totals since the fifo was created. Rates over an interval
+// come from the difference between two snapshots.
+struct fifo_stats {
+    uint64_t elapsed_ns;
+    uint64_t capacity;
+    uint64_t pushes, pops;
+
+    // Producers blocked on a full fifo and consumers on an empty one.
+    // A consumer whose wait only ended with the end of the stream isn't
+    // counted, so shutdown doesn't look like a stall.
+    uint64_t full_waits, full_wait_ns;
+    uint64_t empty_waits, empty_wait_ns;
+
+    uint64_t occupancy_ns[FIFO_OCCUPANCY_BUCKETS];
+};
+
+enum fifo_event {
+    FIFO_EVENT_READABLE,
+    FIFO_EVENT_WRITABLE,
+};
+
+// Counts for fifo_push_n() and fifo_pop_n() since the last call to
+// fifo_batch_stats()
+struct fifo_batch_stats {
+    unsigned long push_calls, push_items;
+    unsigned long pop_calls, pop_items;
+    int max_push, max_pop;
+};
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct fifo *fifo_new(size_t entries);
+
+// Lock-free fifo for exactly one pushing and one popping thread at a
+// time. Used through the same calls as any other fifo.
+struct fifo *fifo_spsc_new(size_t entries);
+
+// Lock-free fifo for any number of pushing and popping threads. Needs
+// at least 2 entries.
+struct fifo *fifo_mpmc_new(size_t entries);
+
+// Lock-free fifo for any number of threads that holds fixed size
+// records inside the ring itself instead of pointers to them. Records
+// are used in place through fifo_reserve() and fifo_peek() below; the
+// pointer based push and pop calls don't apply to it.
+struct fifo *fifo_rec_new(size_t entries, size_t rec_size);
+
 void fifo_free(struct fifo *f);
 
 void fifo_open(struct fifo *f);
@@ -47,8 +97,65 @@ void fifo_close(struct fifo *f);
 void fifo_push(struct fifo *f, void *x);
 void *fifo_pop(struct fifo *f);
 
+// Push all n pointers, blocking as needed, with one wake up per chunk
+// that fits rather than one per pointer
+void fifo_push_n(struct fifo *f, void **x, size_t n);
+
+// Pop between 1 and n pointers, blocking until at least one is
+// available. Returns 0 once the fifo is closed and empty.
+size_t fifo_pop_n(struct fifo *f, void **x, size_t n);
+
+// Record fifos only. fifo_reserve() blocks until a slot is free and
+// returns it for the caller to fill in; fifo_commit() hands it to the
+// consumers. fifo_peek() blocks until a record is committed and returns
+// it, or NULL once the fifo is closed and empty; fifo_release() gives
+// the slot back to the producers. A thread may hold several slots at
+// once, but a slot held too long stalls the fifo once it laps around
+// to it. Records are aligned to 8 bytes.
+//
+// Calling these on a pointer fifo, or the pointer push and pop calls
+// on a record fifo, fails an assertion, or sets errno to EINVAL where
+// assertions are compiled out.
+void *fifo_reserve(struct fifo *f);
+void fifo_commit(struct fifo *f, void *rec);
+const void *fifo_peek(struct fifo *f);
+void fifo_release(struct fifo *f, const void *rec);
+
+// Return NULL with errno set to EAGAIN if the fifo is full
+void *fifo_try_reserve(struct fifo *f);
+
+// Return 1 with the record in *rec, 0 at end of stream or -1 with
+// errno set to EAGAIN if nothing is committed
+int fifo_try_peek(struct fifo *f, const void **rec);
+
+// Return 0, or -1 with errno set to EAGAIN if the fifo is full
+int fifo_try_push(struct fifo *f, void *x);
+
+// Return 1 with the popped pointer in *x, 0 at end of stream or -1
+// with errno set to EAGAIN if the fifo is empty (ETIMEDOUT if the
+// timeout passed). A timeout of 0 waits forever.
+int fifo_try_pop(struct fifo *f, void **x);
+int fifo_pop_timeout(struct fifo *f, void **x, unsigned timeout_ms);
+
+// Returns an eventfd, created on first use, for watching the fifo with
+// poll or epoll alongside other file descriptors. It is edge triggered:
+// FIFO_EVENT_READABLE is signalled when an item (or the final close)
+// arrives after fifo_try_pop() found the fifo empty, and
+// FIFO_EVENT_WRITABLE when space appears after fifo_try_push() found
+// it full. On a record fifo fifo_try_peek() and fifo_try_reserve()
+// take their places. Read the eventfd before retrying so no edge is
+// missed. Call before the fifo is shared between threads.
+int fifo_eventfd(struct fifo *f, enum fifo_event ev);
+
 int fifo_max_fill(struct fifo *f);
 
+// Safe to call at any time from any thread; the counters are read
+// without stopping the fifo
+void fifo_stats(struct fifo *f, struct fifo_stats *stats);
+void fifo_print_stats(const struct fifo_stats *stats, const char *name,
+                      FILE *out);
+void fifo_batch_stats(struct fifo *f, struct fifo_batch_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Lock-free log-linear (HDR style) histogram
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_HIST_H
+#define LIBCAPI_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct hist;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct hist *hist_new(void);
+void hist_free(struct hist *h);
+void hist_reset(struct hist *h);
+
+void hist_record(struct hist *h, uint64_t value);
+
+uint64_t hist_count(struct hist *h);
+uint64_t hist_min(struct hist *h);
+uint64_t hist_max(struct hist *h);
+double hist_mean(struct hist *h);
+uint64_t hist_percentile(struct hist *h, double pct);
+
+void hist_dump(struct hist *h, FILE *out, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -35,5 +35,16 @@
             (type *)( (char *)__mptr - offsetof(type,member) );     \
 })
 
+// Starts a member on its own CAPI cache line; the containing object
+// must come from capi_alloc() or be otherwise suitably aligned.
+#define __cacheline_aligned __attribute__((aligned(128)))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__powerpc__)
+#define cpu_relax() __asm__ __volatile__ ("or 1,1,1\n\tor 2,2,2" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
 
 #endif
@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     File streaming pipeline: reader -> submitter -> wqueue ->
+//     harvester -> writer, each stage a worker thread group connected
+//     by fifos.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_PIPELINE_H
+#define LIBCAPI_PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "capi.h"
+
+struct wqueue;
+struct pipeline;
+
+struct pipeline_opts {
+    int readers;
+    int submitters;
+    int harvesters;
+    int writers;
+    size_t chunk_size;
+    size_t max_inflight;
+    enum capi_backing backing;    // largest page size for the buffers
+    int node;                     // NUMA node for threads and buffers, -1
+                                  // for no placement
+    int wait_forever;             // keep waiting when the AFU times out
+                                  // instead of failing the run
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void pipeline_default_opts(struct pipeline_opts *opts);
+
+struct pipeline *pipeline_new(struct wqueue *wq, int in_fd, int out_fd,
+                              const struct pipeline_opts *opts);
+void pipeline_free(struct pipeline *p);
+
+// Returns -1 if any chunk failed or the AFU stopped completing them
+// within the wqueue's poll timeout, or -1 with errno set if the stage
+// threads couldn't all be started, in which case nothing was processed
+int pipeline_run(struct pipeline *p);
+void pipeline_print_stats(struct pipeline *p, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
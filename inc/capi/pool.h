@@ -0,0 +1,78 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Recycling buffer pool for cache-line-aligned CAPI buffers
+//
+//     Buffers come in power-of-two size classes from
+//     CAPI_CACHELINE_BYTES up to the pool's maximum buffer size. Freed
+//     buffers are kept on a per-thread cache and only move to and from
+//     the shared per-class lists in batches, so pool_get/pool_put
+//     normally take no lock at all and, once warm, never touch the
+//     heap. A buffer may be returned by any thread, not just the one
+//     that allocated it.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_POOL_H
+#define LIBCAPI_POOL_H
+
+#include <stdlib.h>
+
+#include "capi.h"
+
+struct pool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// max_bytes caps the memory the pool holds in total (buffers in use
+// plus those cached), zero means no limit. pool_get fails with ENOMEM
+// once the cap is reached and no free buffer of the class is at hand.
+struct pool *pool_new(size_t max_buf_size, size_t max_bytes);
+
+// Carve the buffers out of slabs of at least 2MB backed by pages up to
+// the given size. max_bytes then counts the buffers handed out of each
+// slab, not the slack at its end.
+struct pool *pool_new_backed(size_t max_buf_size, size_t max_bytes,
+                             enum capi_backing backing);
+
+// Bind all further buffers to a NUMA node, which also moves the pool
+// over to slabs. Only allowed before the first buffer is allocated.
+int pool_set_node(struct pool *p, int node);
+void pool_free(struct pool *p);
+
+void *pool_get(struct pool *p, size_t size);
+void pool_put(void *buf);
+
+// Make sure count free buffers of the given size are on hand and
+// faulted in before the data path needs them
+int pool_prefill(struct pool *p, size_t size, size_t count);
+
+size_t pool_buf_size(const void *buf);
+size_t pool_bytes(struct pool *p);
+
+// The smallest page backing any slab actually got
+enum capi_backing pool_backing(struct pool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
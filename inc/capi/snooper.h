@@ -43,6 +43,17 @@ struct snooper_mmio {
     uint64_t reserved[26];
 };
 
+struct snooper_tag_usage {
+    uint32_t tag_count;
+    uint32_t acc_count;
+};
+
+struct snooper_tag_stats {
+    uint32_t min, max;
+    uint32_t count;
+    uint64_t sum, sum_sq;
+};
+
 void snooper_init(struct snooper_mmio *mmio);
 void snooper_dump(struct cxl_afu_h *afu);
 uint64_t snooper_xor_sum(struct cxl_afu_h *afu);
@@ -50,4 +61,11 @@ uint64_t snooper_tag_alert(struct cxl_afu_h *afu);
 void snooper_tag_usage(struct cxl_afu_h *afu);
 void snooper_tag_stats(struct cxl_afu_h *afu, int dump);
 
+// As above but returning the values rather than printing them. Reading
+// the tag stats drains the tag data the snooper has collected so far.
+int snooper_read_tag_usage(struct cxl_afu_h *afu,
+                           struct snooper_tag_usage *usage);
+int snooper_read_tag_stats(struct cxl_afu_h *afu,
+                           struct snooper_tag_stats *stats, int dump);
+
 #endif
@@ -0,0 +1,58 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     NUMA topology helpers: node CPU sets, the node an AFU hangs off
+//     and binding or querying the node of memory. These go straight to
+//     sysfs and the syscalls so libnuma isn't needed.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_TOPO_H
+#define LIBCAPI_TOPO_H
+
+#include <sched.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int topo_num_nodes(void);
+int topo_node_cpus(int node, cpu_set_t *cpus);
+int topo_current_node(void);
+
+// Node the CXL card behind the given device is attached to, or -1 if
+// it can't be determined (as with the emulator)
+int topo_afu_node(const char *cxl_dev);
+
+// Bind a range that hasn't been touched yet to a node. With strict set
+// the allocation fails rather than spill to another node.
+int topo_bind(void *addr, size_t len, int node, int strict);
+
+// Count the pages of a range resident on each node. counts must hold
+// max_nodes entries; returns the number of pages looked at.
+long topo_page_nodes(const void *addr, size_t len, long *counts,
+                     int max_nodes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
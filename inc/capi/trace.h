@@ -0,0 +1,104 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Low overhead event tracer with Chrome trace export
+//
+//     Every thread records into its own ring so recording takes no
+//     locks. Tracing is compiled in but off until trace_enable() is
+//     called; while off each trace point costs a single load and
+//     branch. trace_dump() writes the JSON that chrome://tracing and
+//     Perfetto read.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_TRACE_H
+#define LIBCAPI_TRACE_H
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Events older than the last TRACE_RING_SIZE of a thread are dropped
+// unless trace_set_ring_size() says otherwise
+#define TRACE_RING_SIZE     (1 << 16)
+
+// Events can also be placed on the AFU's own timeline rather than the
+// recording thread's
+enum trace_track {
+    TRACE_TRACK_THREAD,
+    TRACE_TRACK_AFU,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int trace_on;
+
+void trace_enable(int enable);
+
+// Drops every event recorded so far and frees the rings of threads
+// that have exited
+void trace_clear(void);
+
+// Events kept per thread, rounded up to a power of two. Only rings
+// created afterwards, by threads that haven't traced yet, use it.
+void trace_set_ring_size(size_t events);
+
+void trace_thread_name(const char *name);
+int trace_dump(FILE *out);
+
+// Names must be string literals or otherwise outlive the trace
+void trace_record(char phase, enum trace_track track, const char *name,
+                  uint64_t ts_ns, uint64_t dur_ns, uint64_t arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline int trace_enabled(void)
+{
+    return __builtin_expect(__atomic_load_n(&trace_on, __ATOMIC_RELAXED),
+                            0);
+}
+
+static inline uint64_t trace_begin(void)
+{
+    return trace_enabled() ? utils_monotonic_ns() : 0;
+}
+
+static inline void trace_instant(const char *name, uint64_t arg)
+{
+    if (trace_enabled())
+        trace_record('i', TRACE_TRACK_THREAD, name, utils_monotonic_ns(),
+                     0, arg);
+}
+
+// Record a span started with trace_begin()
+static inline void trace_span(const char *name, uint64_t start_ns,
+                              uint64_t arg)
+{
+    if (trace_enabled() && start_ns)
+        trace_record('X', TRACE_TRACK_THREAD, name, start_ns,
+                     utils_monotonic_ns() - start_ns, arg);
+}
+
+#endif
@@ -30,12 +30,17 @@
 #define LIBCAPI_UTILS_H
 
 #include <sys/time.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 double utils_timeval_to_secs(struct timeval *t);
+uint64_t utils_monotonic_ns(void);
+
+// Same clock at timer tick resolution, for callers that read it often
+uint64_t utils_monotonic_coarse_ns(void);
 
 #ifdef __cplusplus
 }
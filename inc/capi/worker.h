@@ -30,23 +30,39 @@
 #define LIBCAPI_WORKER_H
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdio.h>
 
 struct worker {
     int num_threads;
     pthread_t *threads;
     struct rusage *rusage;
+    void *(*start_routine) (void *);
+
+    // Holds every thread back until all of them have been created
+    sem_t gate;
+    int aborted;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// On failure none of the start routines have run, any threads that
+// were created have exited and errno is set
 int worker_start(struct worker *w, int num_threads,
                  void *(*start_routine) (void *));
+int worker_start_cpus(struct worker *w, int num_threads,
+                      void *(*start_routine) (void *), const cpu_set_t *cpus);
+int worker_start_node(struct worker *w, int num_threads,
+                      void *(*start_routine) (void *), int node);
 void worker_join(struct worker *w);
 void worker_free(struct worker *w);
 void worker_finish_thread(struct worker *);
 void worker_print_cputime(struct worker *w, struct rusage *ru, const char *x);
+void worker_fprint_cputime(struct worker *w, struct rusage *ru, const char *x,
+                           FILE *out);
 
 #ifdef __cplusplus
 }
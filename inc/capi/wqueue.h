@@ -29,6 +29,11 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include "capi.h"
+
+struct iovec;
 
 struct wqueue_mmio {
     uint64_t queue_len;
@@ -57,20 +62,109 @@ struct wqueue_item {
     size_t dst_len;
     unsigned start_time, end_time;
     void *opaque;
+    int error_code;
+    uint32_t src_crc, dst_crc;  // set on pop in checksum mode, see
+                                // wqueue_set_checksum()
+};
+
+enum wqueue_poll_mode {
+    WQ_POLL_ADAPTIVE,   // spin, then exponential backoff, then sleep
+    WQ_POLL_SPIN,       // busy wait with cpu_relax() until done
+    WQ_POLL_SLEEP,      // sleep max_sleep_us between every check
+};
+
+struct wqueue_poll {
+    enum wqueue_poll_mode mode;
+    unsigned spin_us;
+    unsigned min_sleep_us;
+    unsigned max_sleep_us;
+    unsigned timeout_ms;     // 0 waits forever
+};
+
+enum wqueue_doorbell {
+    WQ_DOORBELL_AUTO,   // only trigger when the AFU may have stopped
+    WQ_DOORBELL_ALWAYS, // trigger after every push
+};
+
+enum wqueue_hist_type {
+    WQ_HIST_SERVICE,    // AFU start_time to end_time
+    WQ_HIST_QUEUE,      // host push to AFU start_time
+    WQ_HIST_PICKUP,     // AFU end_time to host pop
+    WQ_HIST_TYPES,
+};
+
+struct wqueue_opts {
+    size_t queue_len;
+    enum capi_backing wed_backing;   // largest page size to try
 };
 
-int wqueue_init(char *cxl_dev, struct wqueue_mmio *_mmio, size_t queue_len);
-void wqueue_cleanup(void);
+struct wqueue;
+struct hist;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct wqueue *wqueue_init(char *cxl_dev, struct wqueue_mmio *mmio,
+                           size_t queue_len);
+struct wqueue *wqueue_init_opts(char *cxl_dev, struct wqueue_mmio *mmio,
+                                const struct wqueue_opts *opts);
+void wqueue_cleanup(struct wqueue *wq);
+
+void wqueue_push(struct wqueue *wq, const struct wqueue_item *qitem);
+void wqueue_push_batch(struct wqueue *wq, const struct wqueue_item *qitems,
+                       size_t n);
+int wqueue_push_sg(struct wqueue *wq, const struct wqueue_item *qitem,
+                   const struct iovec *src, const struct iovec *dst,
+                   int iovcnt);
+int wqueue_submit_large(struct wqueue *wq, const struct wqueue_item *qitem,
+                        size_t chunk_len);
+int wqueue_pop(struct wqueue *wq, struct wqueue_item *qitem);
+int wqueue_pop_batch(struct wqueue *wq, struct wqueue_item *qitems,
+                     size_t max);
+
+int wqueue_try_push(struct wqueue *wq, const struct wqueue_item *qitem);
+int wqueue_try_pop(struct wqueue *wq, struct wqueue_item *qitem);
+int wqueue_event_fd(struct wqueue *wq);
 
-void wqueue_push(const struct wqueue_item *qitem);
-int wqueue_pop(struct wqueue_item *qitem);
+void wqueue_set_poll(struct wqueue *wq, const struct wqueue_poll *poll);
+void wqueue_get_poll(struct wqueue *wq, struct wqueue_poll *poll);
 
-struct cxl_afu_h *wqueue_afu(void);
+struct cxl_afu_h *wqueue_afu(struct wqueue *wq);
+enum capi_backing wqueue_wed_backing(struct wqueue *wq);
+int wqueue_afu_node(struct wqueue *wq);
 
-uint64_t wqueue_xor_sum(void);
+uint64_t wqueue_xor_sum(struct wqueue *wq);
+
+// CRC32C the payload of every item. src_crc is taken from the src
+// buffer as the item is pushed, before the AFU sees it, so for an item
+// processed in place it is the input's CRC. dst_crc is taken from the
+// dst buffer by the popping thread after it has released the queue.
+// Items from wqueue_push_sg() get a src_crc covering all of their
+// segments but no dst_crc, as the popped item doesn't describe the dst
+// segments.
+void wqueue_set_checksum(struct wqueue *wq, int enable);
 
 double wqueue_calc_duration(struct wqueue_item *it);
 
-void wqueue_set_croom(int croom);
+// Record the service, queue and pickup latencies returned by
+// wqueue_hist(). Off by default as it costs a clock read per push and
+// per harvest.
+void wqueue_set_hist(struct wqueue *wq, int enable);
+struct hist *wqueue_hist(struct wqueue *wq, enum wqueue_hist_type type);
+void wqueue_hist_dump(struct wqueue *wq, FILE *out);
+
+void wqueue_set_doorbell(struct wqueue *wq, enum wqueue_doorbell mode);
+void wqueue_doorbell_stats(struct wqueue *wq, uint64_t *rung,
+                           uint64_t *elided);
+
+// Cache lines the AFU has read and written, free running and wrapping
+void wqueue_counters(struct wqueue *wq, uint32_t *read_count,
+                     uint32_t *write_count);
+void wqueue_set_croom(struct wqueue *wq, int croom);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
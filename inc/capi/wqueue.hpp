@@ -0,0 +1,246 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Header only C++20 coroutine front end for the wqueue.
+//
+//     co_await queue.submit(item) suspends the calling coroutine until
+//     the item's WED entry is done and evaluates to the completed
+//     wqueue_item. The queue doubles as a small completion reactor:
+//     poll() harvests whatever is done without blocking and resumes the
+//     waiting coroutines in completion order, wait() sleeps on the
+//     wqueue's eventfd and run() loops until nothing is in flight.
+//     Submissions that find the ring full are parked and retried by the
+//     reactor so a coroutine never blocks the thread it runs on.
+//
+//     Other code may share the wqueue: completions the queue didn't
+//     submit itself, such as end markers or items pushed from C, are
+//     recognised by their opaque pointer not being one of its own
+//     awaiters and handed to the foreign handler instead.
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIBCAPI_WQUEUE_HPP
+#define LIBCAPI_WQUEUE_HPP
+
+#include "wqueue.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+
+namespace capi {
+
+// Minimal eagerly started coroutine type that frees itself when done.
+// Handy for spawning submitters; any other coroutine type can co_await
+// queue.submit() just as well.
+struct detached_task {
+    struct promise_type {
+        detached_task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+class queue {
+public:
+    class submit_awaiter {
+    public:
+        submit_awaiter(queue &q, const wqueue_item &item)
+            : q_(q), item_(item) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle_ = h;
+            user_opaque_ = item_.opaque;
+            item_.opaque = this;
+
+            // The reactor may resume us on another thread as soon as
+            // the item is queued so nothing may touch *this after this.
+            q_.enqueue(this);
+        }
+
+        wqueue_item await_resume() const noexcept { return item_; }
+
+    private:
+        friend class queue;
+
+        void complete(const wqueue_item &done)
+        {
+            item_ = done;
+            item_.opaque = user_opaque_;
+            handle_.resume();
+        }
+
+        queue &q_;
+        wqueue_item item_;
+        void *user_opaque_ = nullptr;
+        std::coroutine_handle<> handle_;
+    };
+
+    using foreign_handler = std::function<void(const wqueue_item &)>;
+
+    explicit queue(struct wqueue *wq) : wq_(wq) {}
+
+    queue(const queue &) = delete;
+    queue &operator=(const queue &) = delete;
+
+    struct wqueue *handle() const noexcept { return wq_; }
+
+    submit_awaiter submit(const wqueue_item &item)
+    {
+        return submit_awaiter(*this, item);
+    }
+
+    // Called from poll() with each completed item this queue didn't
+    // submit. Without a handler such items are dropped. Set it before
+    // the queue is in use.
+    void set_foreign_handler(foreign_handler h)
+    {
+        foreign_ = std::move(h);
+    }
+
+    std::size_t in_flight()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return in_flight_;
+    }
+
+    // Harvests up to max completed items without blocking and resumes
+    // their coroutines in completion order. Returns how many were
+    // resumed.
+    std::size_t poll(std::size_t max = 64)
+    {
+        std::size_t count = 0;
+
+        flush_pending();
+
+        while (count < max) {
+            wqueue_item done;
+            if (wqueue_try_pop(wq_, &done) < 0)
+                break;
+
+            auto *a = take_awaiter(done.opaque);
+
+            flush_pending();
+
+            if (a != nullptr)
+                a->complete(done);
+            else if (foreign_)
+                foreign_(done);
+
+            count++;
+        }
+
+        return count;
+    }
+
+    // Blocks until completions may be pending or timeout_ms passes
+    // (-1 waits forever).
+    void wait(int timeout_ms = -1)
+    {
+        if (event_fd_ < 0)
+            event_fd_ = wqueue_event_fd(wq_);
+
+        if (event_fd_ < 0)
+            return;
+
+        struct pollfd pfd = {};
+        pfd.fd = event_fd_;
+        pfd.events = POLLIN;
+
+        if (::poll(&pfd, 1, timeout_ms) > 0) {
+            std::uint64_t val;
+            if (::read(event_fd_, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                return;
+        }
+    }
+
+    // Drives the reactor until every item submitted through this queue
+    // has completed.
+    void run()
+    {
+        while (in_flight()) {
+            if (!poll())
+                wait(10);
+        }
+    }
+
+private:
+    void enqueue(submit_awaiter *a)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_++;
+        awaiters_.insert(a);
+
+        // Keep submission order if earlier items are still parked.
+        if (!pending_.empty() || wqueue_try_push(wq_, &a->item_) < 0)
+            pending_.push_back(a);
+    }
+
+    // Returns the awaiter an item's opaque pointer refers to, or
+    // nullptr if it isn't one of ours. Only pointers we handed out are
+    // ever dereferenced.
+    submit_awaiter *take_awaiter(void *opaque)
+    {
+        auto *a = static_cast<submit_awaiter *>(opaque);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!awaiters_.erase(a))
+            return nullptr;
+
+        in_flight_--;
+        return a;
+    }
+
+    void flush_pending()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        while (!pending_.empty()) {
+            if (wqueue_try_push(wq_, &pending_.front()->item_) < 0)
+                break;
+            pending_.pop_front();
+        }
+    }
+
+    struct wqueue *wq_;
+    int event_fd_ = -1;
+    std::mutex mutex_;
+    std::deque<submit_awaiter *> pending_;
+    std::unordered_set<submit_awaiter *> awaiters_;
+    std::size_t in_flight_ = 0;
+    foreign_handler foreign_;
+};
+
+}
+
+#endif
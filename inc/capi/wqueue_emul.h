@@ -41,11 +41,24 @@ struct cxl {
                        uint64_t *data);
     int (*mmio_read32)(struct cxl_afu_h *afu, void *offset,
                        uint32_t *data);
+    void (*set_event_fd)(struct cxl_afu_h *afu, int fd);
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 extern const struct cxl *cxl;
 
 void wqueue_emul_init(void);
 
+// Triggers the emulated AFU received, and how many of them arrived
+// while it was busy and so had no effect
+void wqueue_emul_trigger_stats(struct cxl_afu_h *afu, uint64_t *triggers,
+                               uint64_t *redundant);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -24,9 +24,18 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include "capi.h"
+#include "topo.h"
 
+#include <sys/mman.h>
 #include <errno.h>
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define HUGE_2M    (2UL << 20)
+#define HUGE_1G    (1UL << 30)
+
 void *capi_alloc(size_t size)
 {
     void *ret;
@@ -38,3 +47,132 @@ void *capi_alloc(size_t size)
 
     return ret;
 }
+
+static size_t round_up(size_t x, size_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+static void *map_hugetlb(size_t len, int shift)
+{
+    void *ret = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                     (shift << MAP_HUGE_SHIFT), -1, 0);
+
+    return ret == MAP_FAILED ? NULL : ret;
+}
+
+// Map len bytes aligned to a 2MB boundary so transparent hugepages can
+// back the whole range, then ask for them. Whether the kernel actually
+// grants them is only known later, so THP means advised, not promised.
+static void *map_thp(size_t len, int *advised)
+{
+    size_t map_len = len + HUGE_2M;
+    char *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    char *ret = (char *) round_up((size_t) map, HUGE_2M);
+    if (ret > map)
+        munmap(map, ret - map);
+    if (ret + len < map + map_len)
+        munmap(ret + len, map + map_len - (ret + len));
+
+#ifdef MADV_HUGEPAGE
+    *advised = madvise(ret, len, MADV_HUGEPAGE) == 0;
+#else
+    *advised = 0;
+#endif
+
+    return ret;
+}
+
+int capi_alloc_pages(struct capi_mem *mem, size_t size,
+                     enum capi_backing backing)
+{
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (backing >= CAPI_BACKING_HUGE_1G) {
+        mem->len = round_up(size, HUGE_1G);
+        mem->backing = CAPI_BACKING_HUGE_1G;
+        if ((mem->addr = map_hugetlb(mem->len, 30)) != NULL)
+            return 0;
+    }
+
+    if (backing >= CAPI_BACKING_HUGE_2M) {
+        mem->len = round_up(size, HUGE_2M);
+        mem->backing = CAPI_BACKING_HUGE_2M;
+        if ((mem->addr = map_hugetlb(mem->len, 21)) != NULL)
+            return 0;
+    }
+
+    if (backing >= CAPI_BACKING_THP) {
+        int advised;
+
+        mem->len = round_up(size, HUGE_2M);
+        if ((mem->addr = map_thp(mem->len, &advised)) == NULL)
+            return -1;
+
+        mem->backing = advised ? CAPI_BACKING_THP : CAPI_BACKING_NORMAL;
+        return 0;
+    }
+
+    mem->len = round_up(size, CAPI_CACHELINE_BYTES);
+    mem->backing = CAPI_BACKING_NORMAL;
+    mem->addr = mmap(NULL, mem->len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem->addr == MAP_FAILED) {
+        mem->addr = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int capi_alloc_pages_node(struct capi_mem *mem, size_t size,
+                          enum capi_backing backing, int node)
+{
+    if (capi_alloc_pages(mem, size, backing))
+        return -1;
+
+    if (node < 0)
+        return 0;
+
+    // Nothing is faulted in yet so the policy covers every page. Pools
+    // of explicit hugepages aren't per node, so those only prefer the
+    // node instead of risking a SIGBUS when it has none left.
+    int strict = mem->backing < CAPI_BACKING_HUGE_2M;
+    if (topo_bind(mem->addr, mem->len, node, strict)) {
+        int err = errno;
+        capi_free_pages(mem);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+void capi_free_pages(struct capi_mem *mem)
+{
+    if (mem->addr != NULL)
+        munmap(mem->addr, mem->len);
+
+    mem->addr = NULL;
+    mem->len = 0;
+}
+
+const char *capi_backing_name(enum capi_backing backing)
+{
+    switch (backing) {
+    case CAPI_BACKING_NORMAL:  return "normal pages";
+    case CAPI_BACKING_THP:     return "transparent hugepages";
+    case CAPI_BACKING_HUGE_2M: return "2MB hugepages";
+    case CAPI_BACKING_HUGE_1G: return "1GB hugepages";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,226 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     CRC32C (Castagnoli) checksums
+//
+//     On x86 the SSE4.2 crc32 instruction is used when the CPU has it,
+//     running three independent streams over each block so the
+//     instruction's latency is hidden, and the streams are then merged
+//     with carry-less "shift by n zero bytes" tables. Everything else
+//     falls back to slicing-by-8 tables. A POWER8 vpmsum version would
+//     be the natural next step but isn't done.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define POLY            0x82f63b78
+
+// Bytes per stream in each block of the three stream loop
+#define STRIPE_BYTES    1024
+
+static uint32_t table[8][256];
+static uint32_t shift_table[4][256];
+
+static uint32_t (*impl)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static uint32_t sw_crc(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t) p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        x ^= crc;
+
+        crc = table[7][x & 0xff] ^
+            table[6][(x >> 8) & 0xff] ^
+            table[5][(x >> 16) & 0xff] ^
+            table[4][(x >> 24) & 0xff] ^
+            table[3][(x >> 32) & 0xff] ^
+            table[2][(x >> 40) & 0xff] ^
+            table[1][(x >> 48) & 0xff] ^
+            table[0][x >> 56];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+// Multiply two polynomials modulo POLY in the reflected domain
+static uint32_t gf_mul(uint32_t a, uint32_t b)
+{
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++) {
+        if (b & 0x80000000)
+            ret ^= a;
+        b <<= 1;
+        a = (a >> 1) ^ (a & 1 ? POLY : 0);
+    }
+
+    return ret;
+}
+
+// x^(8 * n) mod POLY: what appending n zero bytes multiplies a crc by
+static uint32_t zeros_op(size_t n)
+{
+    uint32_t ret = 0x80000000;      // x^0
+    uint32_t sq = 0x00800000;       // x^8
+
+    while (n) {
+        if (n & 1)
+            ret = gf_mul(ret, sq);
+        sq = gf_mul(sq, sq);
+        n >>= 1;
+    }
+
+    return ret;
+}
+
+// Tables that advance a crc over STRIPE_BYTES zero bytes a byte of the
+// crc at a time
+static void make_shift_table(void)
+{
+    uint32_t op = zeros_op(STRIPE_BYTES);
+
+    for (int i = 0; i < 4; i++)
+        for (int b = 0; b < 256; b++)
+            shift_table[i][b] = gf_mul(op, (uint32_t) b << (8 * i));
+}
+
+static inline uint32_t shift(uint32_t crc)
+{
+    return shift_table[0][crc & 0xff] ^
+        shift_table[1][(crc >> 8) & 0xff] ^
+        shift_table[2][(crc >> 16) & 0xff] ^
+        shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t hw_crc(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c0 = crc;
+
+    while (len && ((uintptr_t) p & 7)) {
+        c0 = __builtin_ia32_crc32qi(c0, *p++);
+        len--;
+    }
+
+    while (len >= 3 * STRIPE_BYTES) {
+        uint64_t c1 = 0, c2 = 0;
+
+        for (int i = 0; i < STRIPE_BYTES; i += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + STRIPE_BYTES + i, 8);
+            memcpy(&c, p + 2 * STRIPE_BYTES + i, 8);
+            c0 = __builtin_ia32_crc32di(c0, a);
+            c1 = __builtin_ia32_crc32di(c1, b);
+            c2 = __builtin_ia32_crc32di(c2, c);
+        }
+
+        c0 = shift(shift(c0) ^ c1) ^ c2;
+
+        p += 3 * STRIPE_BYTES;
+        len -= 3 * STRIPE_BYTES;
+    }
+
+    while (len >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c0 = __builtin_ia32_crc32di(c0, x);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        c0 = __builtin_ia32_crc32qi(c0, *p++);
+
+    return c0;
+}
+
+#endif
+
+static void init(void)
+{
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+        table[0][i] = crc;
+    }
+
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            table[t][i] = table[0][table[t - 1][i] & 0xff] ^
+                (table[t - 1][i] >> 8);
+
+    make_shift_table();
+
+    impl = sw_crc;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        impl = hw_crc;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&init_once, init);
+
+    return ~impl(~crc, buf, len);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    if (!crc1)
+        return crc2;
+
+    return gf_mul(crc1, zeros_op(len2)) ^ crc2;
+}
+
+const char *crc32c_impl(void)
+{
+    pthread_once(&init_once, init);
+
+#if defined(__x86_64__)
+    if (impl == hw_crc)
+        return "sse4.2";
+#endif
+
+    return "table";
+}
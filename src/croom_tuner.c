@@ -0,0 +1,322 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Closed loop tuning of the AFU's command credits (croom)
+//
+//     The search is a plain hill climb: keep stepping croom in one
+//     direction while bytes/s improves by more than min_gain, try the
+//     other direction when it doesn't, and halve the step once neither
+//     direction helps. Intervals with no traffic at all are not scored,
+//     so the tuner simply waits out idle periods.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "croom_tuner.h"
+#include "wqueue.h"
+#include "snooper.h"
+#include "capi.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#define MAX_SAMPLES 256
+
+struct croom_tuner {
+    struct wqueue *wq;
+    struct croom_tuner_opts opts;
+
+    pthread_t thrd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+
+    int done;
+    int best;
+    size_t nsamples;
+    struct croom_sample samples[MAX_SAMPLES];
+};
+
+void croom_tuner_default_opts(struct croom_tuner_opts *opts)
+{
+    opts->min_croom = 1;
+    opts->max_croom = 64;
+    opts->start_croom = 64;
+    opts->step = 16;
+    opts->settle_ms = 20;
+    opts->interval_ms = 200;
+    opts->min_gain = 0.02;
+    opts->use_snooper = 0;
+}
+
+// Sleep for ms milliseconds, returning non-zero if asked to stop
+static int nap(struct croom_tuner *t, unsigned ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&t->mutex);
+    while (!t->stop)
+        if (pthread_cond_timedwait(&t->cond, &t->mutex, &ts) == ETIMEDOUT)
+            break;
+    int ret = t->stop;
+    pthread_mutex_unlock(&t->mutex);
+
+    return ret;
+}
+
+static void record(struct croom_tuner *t, const struct croom_sample *s)
+{
+    pthread_mutex_lock(&t->mutex);
+    if (t->nsamples < MAX_SAMPLES)
+        t->samples[t->nsamples++] = *s;
+    pthread_mutex_unlock(&t->mutex);
+}
+
+static int measure(struct croom_tuner *t, int croom, double *bytes_per_sec)
+{
+    struct cxl_afu_h *afu = wqueue_afu(t->wq);
+    struct snooper_tag_usage u0, u1;
+    struct snooper_tag_stats tags;
+
+    wqueue_set_croom(t->wq, croom);
+    if (nap(t, t->opts.settle_ms))
+        return -1;
+
+    while (1) {
+        uint32_t r0, w0, r1, w1;
+        int snoop = t->opts.use_snooper;
+
+        wqueue_counters(t->wq, &r0, &w0);
+        if (snoop && (snooper_read_tag_usage(afu, &u0) ||
+                      snooper_read_tag_stats(afu, &tags, 0)))
+            snoop = 0;
+        uint64_t start = utils_monotonic_ns();
+
+        if (nap(t, t->opts.interval_ms))
+            return -1;
+
+        wqueue_counters(t->wq, &r1, &w1);
+        uint64_t end = utils_monotonic_ns();
+
+        uint64_t lines = (uint64_t) (uint32_t) (r1 - r0) +
+            (uint32_t) (w1 - w0);
+        if (!lines)
+            continue;
+
+        struct croom_sample s = {
+            .croom = croom,
+            .bytes_per_sec = lines * CAPI_CACHELINE_BYTES * 1e9 /
+                             (end - start),
+        };
+
+        if (snoop) {
+            snooper_read_tag_usage(afu, &u1);
+            snooper_read_tag_stats(afu, &tags, 0);
+
+            uint32_t acc = u1.acc_count - u0.acc_count;
+            if (acc)
+                s.tag_usage = (double) (uint32_t) (u1.tag_count -
+                                                   u0.tag_count) / acc;
+            if (tags.count)
+                s.tag_avg = (double) tags.sum / tags.count;
+        }
+
+        record(t, &s);
+        *bytes_per_sec = s.bytes_per_sec;
+        return 0;
+    }
+}
+
+static int clamp(struct croom_tuner *t, int croom)
+{
+    if (croom < t->opts.min_croom)
+        return t->opts.min_croom;
+    if (croom > t->opts.max_croom)
+        return t->opts.max_croom;
+    return croom;
+}
+
+static void set_best(struct croom_tuner *t, int best, int done)
+{
+    pthread_mutex_lock(&t->mutex);
+    t->best = best;
+    t->done = done;
+    pthread_mutex_unlock(&t->mutex);
+}
+
+static void *tuner_thread(void *arg)
+{
+    struct croom_tuner *t = arg;
+    int step = t->opts.step, dir = 1, flipped = 0;
+    int best = clamp(t, t->opts.start_croom);
+    double best_bw;
+
+    if (measure(t, best, &best_bw))
+        goto hold;
+
+    set_best(t, best, 0);
+
+    while (step >= 1) {
+        int cand = clamp(t, best + dir * step);
+        double bw = 0;
+
+        if (cand != best) {
+            if (measure(t, cand, &bw))
+                goto hold;
+
+            if (bw > best_bw * (1 + t->opts.min_gain)) {
+                best = cand;
+                best_bw = bw;
+                flipped = 0;
+                set_best(t, best, 0);
+                continue;
+            }
+        }
+
+        if (!flipped) {
+            dir = -dir;
+            flipped = 1;
+            continue;
+        }
+
+        step /= 2;
+        flipped = 0;
+    }
+
+    set_best(t, best, 1);
+
+hold:
+    wqueue_set_croom(t->wq, best);
+    return NULL;
+}
+
+struct croom_tuner *croom_tuner_start(struct wqueue *wq,
+                                      const struct croom_tuner_opts *opts)
+{
+    if (opts->min_croom < 1 || opts->max_croom < opts->min_croom ||
+        opts->step < 1 || !opts->interval_ms)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct croom_tuner *t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    t->wq = wq;
+    t->opts = *opts;
+    t->best = clamp(t, opts->start_croom);
+
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr))
+        goto free_t;
+
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&t->cond, &attr))
+    {
+        pthread_condattr_destroy(&attr);
+        goto free_t;
+    }
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_mutex_init(&t->mutex, NULL))
+        goto destroy_cond;
+
+    if (pthread_create(&t->thrd, NULL, tuner_thread, t))
+        goto destroy_mutex;
+
+    return t;
+
+destroy_mutex:
+    pthread_mutex_destroy(&t->mutex);
+destroy_cond:
+    pthread_cond_destroy(&t->cond);
+free_t:
+    free(t);
+    return NULL;
+}
+
+void croom_tuner_stop(struct croom_tuner *t)
+{
+    pthread_mutex_lock(&t->mutex);
+    t->stop = 1;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+
+    pthread_join(t->thrd, NULL);
+
+    pthread_mutex_destroy(&t->mutex);
+    pthread_cond_destroy(&t->cond);
+    free(t);
+}
+
+int croom_tuner_done(struct croom_tuner *t)
+{
+    pthread_mutex_lock(&t->mutex);
+    int ret = t->done;
+    pthread_mutex_unlock(&t->mutex);
+
+    return ret;
+}
+
+int croom_tuner_best(struct croom_tuner *t)
+{
+    pthread_mutex_lock(&t->mutex);
+    int ret = t->best;
+    pthread_mutex_unlock(&t->mutex);
+
+    return ret;
+}
+
+size_t croom_tuner_curve(struct croom_tuner *t, struct croom_sample *out,
+                         size_t max)
+{
+    pthread_mutex_lock(&t->mutex);
+    size_t n = t->nsamples < max ? t->nsamples : max;
+    for (size_t i = 0; i < n; i++)
+        out[i] = t->samples[i];
+    pthread_mutex_unlock(&t->mutex);
+
+    return n;
+}
+
+void croom_tuner_print(struct croom_tuner *t, FILE *out)
+{
+    struct croom_sample s[MAX_SAMPLES];
+    size_t n = croom_tuner_curve(t, s, MAX_SAMPLES);
+
+    fprintf(out, "croom %s at %d\n",
+            croom_tuner_done(t) ? "settled" : "still searching",
+            croom_tuner_best(t));
+    fprintf(out, "  croom        MB/s   tag usage    tag time\n");
+
+    for (size_t i = 0; i < n; i++)
+        fprintf(out, "  %5d  %10.1f  %10.3e  %10.1f\n", s[i].croom,
+                s[i].bytes_per_sec / 1e6, s[i].tag_usage, s[i].tag_avg);
+}
@@ -23,66 +23,98 @@
 //   Description:
 //     Thread Safe Fifo
 //
+//     fifo_new() gives the general mutex and condvar based fifo; the
+//     other variants live in their own files and are reached through
+//     the same calls via struct fifo_ops.
+//
 ////////////////////////////////////////////////////////////////////////
 
-#include "fifo.h"
+#include "fifo_priv.h"
+#include "trace.h"
+#include "macro.h"
 
+#include <sys/eventfd.h>
 #include <pthread.h>
+#include <assert.h>
 #include <errno.h>
 
-struct fifo {
+struct fifo_locked {
+    struct fifo fifo;
+
     void **queue;
     int push_ptr, pop_ptr;
     int mask;
 
     int readers;
+    int push_armed, pop_armed;
     int max_fill;
+    uint64_t pushes, pops;
+    struct fifo_batch_count push_batch, pop_batch;
+    struct fifo_telemetry tel;
 
     pthread_mutex_t mutex;
     pthread_cond_t push_cond, pop_cond;
 };
 
-static int is_power_of_two(size_t x)
+static const struct fifo_ops locked_ops;
+
+static inline struct fifo_locked *to_locked(struct fifo *f)
 {
-    return (x & (x-1)) == 0;
+    return container_of(f, struct fifo_locked, fifo);
 }
 
 struct fifo *fifo_new(size_t entries)
 {
-    if (!is_power_of_two(entries)) {
+    if (!fifo_is_power_of_two(entries)) {
         errno = EINVAL;
         return NULL;
     }
 
-    struct fifo *f = malloc(sizeof(*f));
+    struct fifo_locked *f = malloc(sizeof(*f));
     if (f == NULL)
         return NULL;
 
+    // Timed waits use the same clock as utils_monotonic_ns()
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr))
+        goto error_free;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
     if (pthread_mutex_init(&f->mutex, NULL) ||
-        pthread_cond_init(&f->push_cond, NULL) ||
-        pthread_cond_init(&f->pop_cond, NULL))
+        pthread_cond_init(&f->push_cond, &attr) ||
+        pthread_cond_init(&f->pop_cond, &attr))
     {
+        pthread_condattr_destroy(&attr);
         goto error_free;
     }
 
+    pthread_condattr_destroy(&attr);
+
     f->queue = malloc(sizeof(*f->queue) * entries);
     if (f->queue == NULL)
         goto error_free;
 
+    fifo_init(&f->fifo, &locked_ops, entries - 1, &f->push_batch,
+              &f->pop_batch, &f->tel);
+    f->pushes = f->pops = 0;
+    f->push_batch = f->pop_batch = (struct fifo_batch_count){};
     f->push_ptr = f->pop_ptr = 0;
     f->mask = entries - 1;
     f->max_fill = 0;
     f->readers = 0;
+    f->push_armed = f->pop_armed = 0;
 
-    return f;
+    return &f->fifo;
 
 error_free:
     free(f);
     return NULL;
 }
 
-void fifo_free(struct fifo *f)
+static void locked_free(struct fifo *fifo)
 {
+    struct fifo_locked *f = to_locked(fifo);
+
     while (pthread_cond_destroy(&f->pop_cond));
     while (pthread_cond_destroy(&f->push_cond));
     while (pthread_mutex_destroy(&f->mutex));
@@ -91,44 +123,98 @@ void fifo_free(struct fifo *f)
     free(f);
 }
 
-const static inline int isempty(const struct fifo *f)
+const static inline int isempty(const struct fifo_locked *f)
 {
     return f->push_ptr == f->pop_ptr;
 }
 
-const static inline int isfull(const struct fifo *f)
+const static inline int isfull(const struct fifo_locked *f)
 {
     return ((f->push_ptr + 1) & f->mask) == f->pop_ptr;
 }
 
-const static inline int num_available(const struct fifo *f)
+const static inline int num_available(const struct fifo_locked *f)
 {
     return (f->push_ptr - f->pop_ptr) & f->mask;
 }
 
-void fifo_open(struct fifo *f)
+// Called with the lock held. As with the lock-free variants, an eventfd
+// is only signalled when an item or a slot turns up after somebody
+// found the fifo empty or full, which arms that side.
+static void signal_armed(struct fifo_locked *f, int *armed,
+                         enum fifo_event ev)
 {
-  pthread_mutex_lock(&f->mutex);
-  f->readers++;
-  pthread_mutex_unlock(&f->mutex);
+    if (*armed) {
+        *armed = 0;
+        fifo_signal(&f->fifo, ev);
+    }
 }
 
+// Called with the lock held before each change to the fifo
+static void sample(struct fifo_locked *f)
+{
+    uint64_t dt = fifo_sample_due(&f->fifo);
 
-void fifo_close(struct fifo *f)
+    if (dt)
+        fifo_sample(&f->fifo, dt, num_available(f));
+}
+
+// Returns non-zero if the deadline passed first
+static int wait_until(struct fifo_locked *f, pthread_cond_t *cond,
+                      uint64_t deadline)
 {
+    if (deadline == FIFO_FOREVER)
+        return pthread_cond_wait(cond, &f->mutex);
+
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+
+    return pthread_cond_timedwait(cond, &f->mutex, &ts) == ETIMEDOUT;
+}
+
+static void locked_open(struct fifo *fifo)
+{
+    struct fifo_locked *f = to_locked(fifo);
+
+    pthread_mutex_lock(&f->mutex);
+    f->readers++;
+    pthread_mutex_unlock(&f->mutex);
+}
+
+static void locked_close(struct fifo *fifo)
+{
+    struct fifo_locked *f = to_locked(fifo);
+
     pthread_mutex_lock(&f->mutex);
     f->readers--;
     pthread_cond_broadcast(&f->pop_cond);
+    fifo_signal(fifo, FIFO_EVENT_READABLE);
     pthread_mutex_unlock(&f->mutex);
 }
 
-void fifo_push(struct fifo *f, void *x)
+static void locked_push(struct fifo *fifo, void *x)
 {
+    struct fifo_locked *f = to_locked(fifo);
+
     pthread_mutex_lock(&f->mutex);
 
-    while (isfull(f))
-        pthread_cond_wait(&f->push_cond, &f->mutex);
+    if (isfull(f)) {
+        uint64_t wait_start = utils_monotonic_ns();
 
+        f->push_armed = 1;
+        while (isfull(f))
+            pthread_cond_wait(&f->push_cond, &f->mutex);
+
+        fifo_count_wait(&f->tel.full, wait_start);
+        trace_span("fifo full", wait_start, (uintptr_t) f);
+    }
+
+    sample(f);
+    signal_armed(f, &f->pop_armed, FIFO_EVENT_READABLE);
+
+    f->pushes++;
     f->queue[f->push_ptr] = x;
     f->push_ptr++;
     f->push_ptr &= f->mask;
@@ -138,21 +224,38 @@ void fifo_push(struct fifo *f, void *x)
     if (num_available(f) > f->max_fill)
         f->max_fill = num_available(f);
 
+    trace_instant("fifo push", num_available(f));
+
     pthread_mutex_unlock(&f->mutex);
 }
 
-void *fifo_pop(struct fifo *f)
+static void *locked_pop(struct fifo *fifo)
 {
+    struct fifo_locked *f = to_locked(fifo);
+
     pthread_mutex_lock(&f->mutex);
 
-    while(isempty(f) && f->readers)
-        pthread_cond_wait(&f->pop_cond, &f->mutex);
+    if (isempty(f) && f->readers) {
+        uint64_t wait_start = utils_monotonic_ns();
+
+        f->pop_armed = 1;
+        while(isempty(f) && f->readers)
+            pthread_cond_wait(&f->pop_cond, &f->mutex);
+
+        if (!isempty(f))
+            fifo_count_wait(&f->tel.empty, wait_start);
+        trace_span("fifo empty", wait_start, (uintptr_t) f);
+    }
 
     if (isempty(f) && !f->readers) {
         pthread_mutex_unlock(&f->mutex);
         return NULL;
     }
 
+    sample(f);
+    signal_armed(f, &f->push_armed, FIFO_EVENT_WRITABLE);
+
+    f->pops++;
     void *ret = f->queue[f->pop_ptr];
 
     f->pop_ptr++;
@@ -160,13 +263,124 @@ void *fifo_pop(struct fifo *f)
 
     pthread_cond_signal(&f->push_cond);
 
+    trace_instant("fifo pop", num_available(f));
+
     pthread_mutex_unlock(&f->mutex);
 
     return ret;
 }
 
-int fifo_max_fill(struct fifo *f)
+// Waiters are woken with a broadcast as a chunk may satisfy several
+static size_t locked_push_n(struct fifo *fifo, void **x, size_t n,
+                            uint64_t deadline)
+{
+    struct fifo_locked *f = to_locked(fifo);
+    size_t pushed = 0;
+
+    pthread_mutex_lock(&f->mutex);
+
+    while (pushed < n) {
+        if (isfull(f)) {
+            f->push_armed = 1;
+            if (deadline == FIFO_NOWAIT)
+                break;
+
+            uint64_t wait_start = utils_monotonic_ns();
+            int expired = 0;
+
+            while (isfull(f) && !expired)
+                expired = wait_until(f, &f->push_cond, deadline);
+
+            fifo_count_wait(&f->tel.full, wait_start);
+            trace_span("fifo full", wait_start, (uintptr_t) f);
+
+            if (isfull(f))
+                break;
+        }
+
+        sample(f);
+        signal_armed(f, &f->pop_armed, FIFO_EVENT_READABLE);
+
+        size_t count = f->mask - num_available(f);
+        if (count > n - pushed)
+            count = n - pushed;
+
+        for (size_t i = 0; i < count; i++) {
+            f->queue[f->push_ptr] = x[pushed + i];
+            f->push_ptr = (f->push_ptr + 1) & f->mask;
+        }
+
+        pushed += count;
+        f->pushes += count;
+
+        pthread_cond_broadcast(&f->pop_cond);
+
+        if (num_available(f) > f->max_fill)
+            f->max_fill = num_available(f);
+
+        trace_instant("fifo push", num_available(f));
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+
+    return pushed;
+}
+
+static int locked_pop_n(struct fifo *fifo, void **x, size_t n,
+                        uint64_t deadline)
+{
+    struct fifo_locked *f = to_locked(fifo);
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (isempty(f) && f->readers)
+        f->pop_armed = 1;
+
+    if (isempty(f) && f->readers && deadline != FIFO_NOWAIT) {
+        uint64_t wait_start = utils_monotonic_ns();
+        int expired = 0;
+
+        while(isempty(f) && f->readers && !expired)
+            expired = wait_until(f, &f->pop_cond, deadline);
+
+        if (!isempty(f))
+            fifo_count_wait(&f->tel.empty, wait_start);
+        trace_span("fifo empty", wait_start, (uintptr_t) f);
+    }
+
+    if (isempty(f) && f->readers) {
+        pthread_mutex_unlock(&f->mutex);
+        return -1;
+    }
+
+    sample(f);
+
+    size_t count = num_available(f);
+    if (count > n)
+        count = n;
+
+    for (size_t i = 0; i < count; i++) {
+        x[i] = f->queue[f->pop_ptr];
+        f->pop_ptr = (f->pop_ptr + 1) & f->mask;
+    }
+
+    f->pops += count;
+
+    if (count) {
+        signal_armed(f, &f->push_armed, FIFO_EVENT_WRITABLE);
+        pthread_cond_broadcast(&f->push_cond);
+        trace_instant("fifo pop", num_available(f));
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+
+    return count;
+}
+
+static int locked_max_fill(struct fifo *fifo)
 {
+    struct fifo_locked *f = to_locked(fifo);
+
     pthread_mutex_lock(&f->mutex);
 
     int ret = f->max_fill;
@@ -176,3 +390,290 @@ int fifo_max_fill(struct fifo *f)
 
     return ret;
 }
+
+static void locked_counts(struct fifo *fifo, uint64_t *pushes,
+                          uint64_t *pops)
+{
+    struct fifo_locked *f = to_locked(fifo);
+
+    pthread_mutex_lock(&f->mutex);
+    *pushes = f->pushes;
+    *pops = f->pops;
+    pthread_mutex_unlock(&f->mutex);
+}
+
+static const struct fifo_ops locked_ops = {
+    .free = locked_free,
+    .open = locked_open,
+    .close = locked_close,
+    .push = locked_push,
+    .pop = locked_pop,
+    .push_n = locked_push_n,
+    .pop_n = locked_pop_n,
+    .reserve = fifo_unsupported_reserve,
+    .commit = fifo_unsupported_commit,
+    .peek = fifo_unsupported_peek,
+    .release = fifo_unsupported_release,
+    .max_fill = locked_max_fill,
+    .counts = locked_counts,
+};
+
+void fifo_unsupported_push(struct fifo *f, void *x)
+{
+    assert(!"fifo_push() on a record fifo");
+    errno = EINVAL;
+}
+
+void *fifo_unsupported_pop(struct fifo *f)
+{
+    assert(!"fifo_pop() on a record fifo");
+    errno = EINVAL;
+    return NULL;
+}
+
+size_t fifo_unsupported_push_n(struct fifo *f, void **x, size_t n,
+                               uint64_t deadline)
+{
+    assert(!"pushing pointers to a record fifo");
+    errno = EINVAL;
+    return 0;
+}
+
+int fifo_unsupported_pop_n(struct fifo *f, void **x, size_t n,
+                           uint64_t deadline)
+{
+    assert(!"popping pointers from a record fifo");
+    errno = EINVAL;
+    return 0;
+}
+
+void *fifo_unsupported_reserve(struct fifo *f, uint64_t deadline)
+{
+    assert(!"reserving a record in a pointer fifo");
+    errno = EINVAL;
+    return NULL;
+}
+
+void fifo_unsupported_commit(struct fifo *f, void *rec)
+{
+    assert(!"fifo_commit() on a pointer fifo");
+    errno = EINVAL;
+}
+
+int fifo_unsupported_peek(struct fifo *f, const void **rec,
+                          uint64_t deadline)
+{
+    assert(!"peeking at a record in a pointer fifo");
+    errno = EINVAL;
+    return 0;
+}
+
+void fifo_unsupported_release(struct fifo *f, const void *rec)
+{
+    assert(!"fifo_release() on a pointer fifo");
+    errno = EINVAL;
+}
+
+void fifo_free(struct fifo *f)
+{
+    if (f->event_fd[FIFO_EVENT_READABLE] >= 0)
+        close(f->event_fd[FIFO_EVENT_READABLE]);
+    if (f->event_fd[FIFO_EVENT_WRITABLE] >= 0)
+        close(f->event_fd[FIFO_EVENT_WRITABLE]);
+
+    f->ops->free(f);
+}
+
+void fifo_open(struct fifo *f)
+{
+    f->ops->open(f);
+}
+
+void fifo_close(struct fifo *f)
+{
+    f->ops->close(f);
+}
+
+void fifo_push(struct fifo *f, void *x)
+{
+    f->ops->push(f, x);
+}
+
+void *fifo_pop(struct fifo *f)
+{
+    return f->ops->pop(f);
+}
+
+void fifo_push_n(struct fifo *f, void **x, size_t n)
+{
+    if (!n)
+        return;
+
+    fifo_batch_add(f->push_batch, n);
+    f->ops->push_n(f, x, n, FIFO_FOREVER);
+}
+
+size_t fifo_pop_n(struct fifo *f, void **x, size_t n)
+{
+    if (!n)
+        return 0;
+
+    int ret = f->ops->pop_n(f, x, n, FIFO_FOREVER);
+    if (ret > 0)
+        fifo_batch_add(f->pop_batch, ret);
+
+    return ret;
+}
+
+void *fifo_reserve(struct fifo *f)
+{
+    return f->ops->reserve(f, FIFO_FOREVER);
+}
+
+void *fifo_try_reserve(struct fifo *f)
+{
+    // Left as is if the fifo is full; the stub for pointer fifos
+    // replaces it with EINVAL
+    errno = EAGAIN;
+
+    return f->ops->reserve(f, FIFO_NOWAIT);
+}
+
+void fifo_commit(struct fifo *f, void *rec)
+{
+    f->ops->commit(f, rec);
+}
+
+const void *fifo_peek(struct fifo *f)
+{
+    const void *rec;
+
+    return f->ops->peek(f, &rec, FIFO_FOREVER) > 0 ? rec : NULL;
+}
+
+int fifo_try_peek(struct fifo *f, const void **rec)
+{
+    int ret = f->ops->peek(f, rec, FIFO_NOWAIT);
+    if (ret < 0)
+        errno = EAGAIN;
+
+    return ret;
+}
+
+void fifo_release(struct fifo *f, const void *rec)
+{
+    f->ops->release(f, rec);
+}
+
+int fifo_try_push(struct fifo *f, void *x)
+{
+    if (f->ops->push_n(f, &x, 1, FIFO_NOWAIT))
+        return 0;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int fifo_try_pop(struct fifo *f, void **x)
+{
+    int ret = f->ops->pop_n(f, x, 1, FIFO_NOWAIT);
+    if (ret < 0)
+        errno = EAGAIN;
+
+    return ret;
+}
+
+int fifo_pop_timeout(struct fifo *f, void **x, unsigned timeout_ms)
+{
+    uint64_t deadline = FIFO_FOREVER;
+    if (timeout_ms)
+        deadline = utils_monotonic_ns() + timeout_ms * 1000000ULL;
+
+    int ret = f->ops->pop_n(f, x, 1, deadline);
+    if (ret < 0)
+        errno = ETIMEDOUT;
+
+    return ret;
+}
+
+int fifo_eventfd(struct fifo *f, enum fifo_event ev)
+{
+    if (f->event_fd[ev] < 0)
+        f->event_fd[ev] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    return f->event_fd[ev];
+}
+
+int fifo_max_fill(struct fifo *f)
+{
+    return f->ops->max_fill(f);
+}
+
+void fifo_stats(struct fifo *f, struct fifo_stats *stats)
+{
+    struct fifo_telemetry *t = f->tel;
+    uint64_t now = utils_monotonic_coarse_ns();
+
+    f->ops->counts(f, &stats->pushes, &stats->pops);
+    stats->elapsed_ns = now - t->start_ns;
+    stats->capacity = f->capacity;
+
+    stats->full_waits = __atomic_load_n(&t->full.waits, __ATOMIC_RELAXED);
+    stats->full_wait_ns = __atomic_load_n(&t->full.ns, __ATOMIC_RELAXED);
+    stats->empty_waits = __atomic_load_n(&t->empty.waits, __ATOMIC_RELAXED);
+    stats->empty_wait_ns = __atomic_load_n(&t->empty.ns, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < FIFO_OCCUPANCY_BUCKETS; i++)
+        stats->occupancy_ns[i] = __atomic_load_n(&t->occupancy_ns[i],
+                                                 __ATOMIC_RELAXED);
+
+    // Charge the time since the last sample to the current level so a
+    // fifo that has stalled shows up where it is stuck
+    uint64_t last = __atomic_load_n(&t->sample_ns, __ATOMIC_RELAXED);
+    uint64_t fill = stats->pushes - stats->pops;
+    if (now > last && stats->pushes >= stats->pops)
+        stats->occupancy_ns[fifo_occupancy_bucket(fill, f->capacity)] +=
+            now - last;
+}
+
+void fifo_print_stats(const struct fifo_stats *stats, const char *name,
+                      FILE *out)
+{
+    double secs = stats->elapsed_ns / 1e9;
+    uint64_t total = 0;
+
+    for (int i = 0; i < FIFO_OCCUPANCY_BUCKETS; i++)
+        total += stats->occupancy_ns[i];
+
+    fprintf(out, "%-10s  %10.0f push/s  %10.0f pop/s  "
+            "full %6llu waits %8.3f s  empty %6llu waits %8.3f s\n",
+            name, secs ? stats->pushes / secs : 0,
+            secs ? stats->pops / secs : 0,
+            (unsigned long long) stats->full_waits,
+            stats->full_wait_ns / 1e9,
+            (unsigned long long) stats->empty_waits,
+            stats->empty_wait_ns / 1e9);
+
+    fprintf(out, "%-10s  occupancy %%:", "");
+    for (int i = 0; i < FIFO_OCCUPANCY_BUCKETS; i++)
+        fprintf(out, " %5.1f", total ? 100.0 * stats->occupancy_ns[i] / total
+                : 0);
+    fprintf(out, "  (empty .. full of %llu)\n",
+            (unsigned long long) stats->capacity);
+}
+
+static void take_batch(struct fifo_batch_count *c, unsigned long *calls,
+                       unsigned long *items, int *max)
+{
+    *calls = __atomic_exchange_n(&c->calls, 0, __ATOMIC_RELAXED);
+    *items = __atomic_exchange_n(&c->items, 0, __ATOMIC_RELAXED);
+    *max = __atomic_exchange_n(&c->max, 0, __ATOMIC_RELAXED);
+}
+
+void fifo_batch_stats(struct fifo *f, struct fifo_batch_stats *stats)
+{
+    take_batch(f->push_batch, &stats->push_calls, &stats->push_items,
+               &stats->max_push);
+    take_batch(f->pop_batch, &stats->pop_calls, &stats->pop_items,
+               &stats->max_pop);
+}
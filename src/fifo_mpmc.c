@@ -0,0 +1,404 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Lock-free bounded multi producer, multi consumer fifo
+//
+//     Every slot carries a sequence number telling whether it is ready
+//     to be filled or emptied for the current lap around the ring.
+//     Pushers and poppers each claim a position with a compare and
+//     swap on their own index, so neither side takes a lock and the
+//     two sides never contend with each other. Threads that find the
+//     fifo full or empty spin briefly and then sleep on a futex. The
+//     other side only makes the wake up syscall when it sees sleepers.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "fifo_priv.h"
+#include "capi.h"
+#include "macro.h"
+#include "trace.h"
+
+#include <string.h>
+#include <errno.h>
+
+// The push side reads the pop index to sample the fill level only once
+// every this many pushes
+#define FILL_SAMPLE 64
+
+struct slot {
+    uint64_t seq;
+    void *data;
+};
+
+struct fifo_mpmc {
+    struct fifo fifo;
+
+    struct slot *slots;
+    uint32_t mask;
+    int spin;
+
+    uint64_t tail __cacheline_aligned;
+    struct fifo_batch_count push_batch;
+
+    uint64_t head __cacheline_aligned;
+    struct fifo_batch_count pop_batch;
+
+    // Only written by threads that have to sleep, on open and close and
+    // when a new maximum fill is seen
+    int readers __cacheline_aligned;
+    int max_fill;
+    struct fifo_waitq push_wait, pop_wait;
+    struct fifo_telemetry tel;
+};
+
+static const struct fifo_ops mpmc_ops;
+
+// Called before claiming slots
+static inline void sample(struct fifo_mpmc *f)
+{
+    uint64_t dt = fifo_sample_due(&f->fifo);
+
+    if (dt)
+        fifo_sample(&f->fifo, dt,
+                    __atomic_load_n(&f->tail, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&f->head, __ATOMIC_RELAXED));
+}
+
+static inline struct fifo_mpmc *to_mpmc(struct fifo *f)
+{
+    return container_of(f, struct fifo_mpmc, fifo);
+}
+
+struct fifo *fifo_mpmc_new(size_t entries)
+{
+    if (!fifo_is_power_of_two(entries) || entries < 2 ||
+        entries > (1U << 31))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct fifo_mpmc *f = capi_alloc(sizeof(*f));
+    if (f == NULL)
+        return NULL;
+
+    memset(f, 0, sizeof(*f));
+
+    f->slots = capi_alloc(sizeof(*f->slots) * entries);
+    if (f->slots == NULL)
+        goto error_free;
+
+    for (uint32_t i = 0; i < entries; i++)
+        f->slots[i].seq = i;
+
+    fifo_init(&f->fifo, &mpmc_ops, entries, &f->push_batch, &f->pop_batch,
+              &f->tel);
+    f->mask = entries - 1;
+    f->spin = fifo_spin_loops();
+
+    return &f->fifo;
+
+error_free:
+    free(f);
+    return NULL;
+}
+
+static void mpmc_free(struct fifo *fifo)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+
+    free(f->slots);
+    free(f);
+}
+
+static void mpmc_open(struct fifo *fifo)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+
+    __atomic_add_fetch(&f->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void mpmc_close(struct fifo *fifo)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+
+    __atomic_sub_fetch(&f->readers, 1, __ATOMIC_SEQ_CST);
+    fifo_wake_all(fifo, &f->pop_wait);
+}
+
+static inline uint64_t slot_seq(struct fifo_mpmc *f, uint64_t pos)
+{
+    return __atomic_load_n(&f->slots[pos & f->mask].seq, __ATOMIC_SEQ_CST);
+}
+
+// Claims up to max consecutive positions on one side of the ring. A
+// slot is ready for the position pos once its sequence number reaches
+// pos + ready. Returns how many were claimed, 0 if none were ready.
+static uint32_t claim(struct fifo_mpmc *f, uint64_t *index, uint64_t ready,
+                      uint64_t *pos_out, uint32_t max)
+{
+    uint64_t pos = __atomic_load_n(index, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int64_t dif = slot_seq(f, pos) - (pos + ready);
+
+        if (dif < 0)
+            return 0;
+
+        if (dif > 0) {
+            pos = __atomic_load_n(index, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint32_t count = 1;
+        while (count < max && slot_seq(f, pos + count) == pos + count + ready)
+            count++;
+
+        if (__atomic_compare_exchange_n(index, &pos, pos + count, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *pos_out = pos;
+            return count;
+        }
+    }
+}
+
+static uint32_t claim_push(struct fifo_mpmc *f, uint64_t *pos,
+                           uint32_t max)
+{
+    return claim(f, &f->tail, 0, pos, max);
+}
+
+static uint32_t claim_pop(struct fifo_mpmc *f, uint64_t *pos, uint32_t max)
+{
+    return claim(f, &f->head, 1, pos, max);
+}
+
+// Spin for a while, then sleep on the waitq until a slot can be claimed
+// or the deadline passes
+static uint32_t wait_push(struct fifo_mpmc *f, uint64_t *pos, uint32_t max,
+                          uint64_t deadline)
+{
+    uint32_t count;
+
+    fifo_update_max(&f->max_fill, f->mask + 1);
+
+    if (deadline == FIFO_NOWAIT) {
+        fifo_wait_arm_event(&f->push_wait);
+        return claim_push(f, pos, max);
+    }
+
+    uint64_t wait_start = utils_monotonic_ns();
+
+    int i;
+    for (i = 0; ; i++) {
+        uint32_t seq = 0;
+
+        if (i >= f->spin)
+            seq = fifo_wait_arm(&f->push_wait, i == f->spin);
+
+        count = claim_push(f, pos, max);
+        if (count || fifo_expired(deadline))
+            break;
+
+        if (i < f->spin)
+            cpu_relax();
+        else
+            fifo_wait_sleep(&f->push_wait, seq, deadline);
+    }
+
+    if (i >= f->spin)
+        fifo_wait_done(&f->push_wait);
+
+    fifo_count_wait(&f->tel.full, wait_start);
+    trace_span("fifo full", wait_start, (uintptr_t) f);
+
+    return count;
+}
+
+// Returns the number of slots claimed, 0 if the fifo is empty and no
+// longer open or -1 if it is just empty
+static int try_claim_pop(struct fifo_mpmc *f, uint64_t *pos, uint32_t max)
+{
+    uint32_t count = claim_pop(f, pos, max);
+    if (count)
+        return count;
+
+    if (__atomic_load_n(&f->readers, __ATOMIC_SEQ_CST))
+        return -1;
+
+    // Anything pushed before the last close is visible once the close
+    // is, so a second look settles whether we're finished
+    return claim_pop(f, pos, max);
+}
+
+static int wait_pop(struct fifo_mpmc *f, uint64_t *pos, uint32_t max,
+                    uint64_t deadline)
+{
+    int ret;
+
+    if (deadline == FIFO_NOWAIT) {
+        fifo_wait_arm_event(&f->pop_wait);
+        return try_claim_pop(f, pos, max);
+    }
+
+    uint64_t wait_start = utils_monotonic_ns();
+
+    int i;
+    for (i = 0; ; i++) {
+        uint32_t seq = 0;
+
+        if (i >= f->spin)
+            seq = fifo_wait_arm(&f->pop_wait, i == f->spin);
+
+        ret = try_claim_pop(f, pos, max);
+        if (ret >= 0 || fifo_expired(deadline))
+            break;
+
+        if (i < f->spin)
+            cpu_relax();
+        else
+            fifo_wait_sleep(&f->pop_wait, seq, deadline);
+    }
+
+    if (i >= f->spin)
+        fifo_wait_done(&f->pop_wait);
+
+    if (ret > 0)
+        fifo_count_wait(&f->tel.empty, wait_start);
+    trace_span("fifo empty", wait_start, (uintptr_t) f);
+
+    return ret;
+}
+
+static size_t mpmc_push_n(struct fifo *fifo, void **x, size_t n,
+                          uint64_t deadline)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+    size_t pushed = 0;
+
+    while (pushed < n) {
+        uint32_t max = n - pushed > f->mask ? f->mask + 1 : n - pushed;
+        uint64_t pos;
+
+        sample(f);
+
+        uint32_t count = claim_push(f, &pos, max);
+        if (!count)
+            count = wait_push(f, &pos, max, deadline);
+        if (!count)
+            break;
+
+        for (uint32_t i = 0; i < count; i++) {
+            struct slot *s = &f->slots[(pos + i) & f->mask];
+            s->data = x[pushed + i];
+            __atomic_store_n(&s->seq, pos + i + 1, __ATOMIC_SEQ_CST);
+        }
+
+        fifo_wake(fifo, &f->pop_wait, FIFO_EVENT_READABLE);
+
+        if ((pos ^ (pos + count)) & ~(FILL_SAMPLE - 1) || trace_enabled()) {
+            int fill = pos + count -
+                __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+            fifo_update_max(&f->max_fill, fill);
+            trace_instant("fifo push", fill);
+        }
+
+        pushed += count;
+    }
+
+    return pushed;
+}
+
+static int mpmc_pop_n(struct fifo *fifo, void **x, size_t n,
+                      uint64_t deadline)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+    uint32_t max = n > f->mask ? f->mask + 1 : n;
+    uint64_t pos;
+
+    sample(f);
+
+    int count = claim_pop(f, &pos, max);
+    if (!count) {
+        count = wait_pop(f, &pos, max, deadline);
+        if (count <= 0)
+            return count;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct slot *s = &f->slots[(pos + i) & f->mask];
+        x[i] = s->data;
+        __atomic_store_n(&s->seq, pos + i + f->mask + 1, __ATOMIC_SEQ_CST);
+    }
+
+    fifo_wake(fifo, &f->push_wait, FIFO_EVENT_WRITABLE);
+
+    if (trace_enabled())
+        trace_instant("fifo pop", __atomic_load_n(&f->tail, __ATOMIC_RELAXED) -
+                      pos - count);
+
+    return count;
+}
+
+static void mpmc_push(struct fifo *fifo, void *x)
+{
+    mpmc_push_n(fifo, &x, 1, FIFO_FOREVER);
+}
+
+static void *mpmc_pop(struct fifo *fifo)
+{
+    void *ret;
+
+    return mpmc_pop_n(fifo, &ret, 1, FIFO_FOREVER) > 0 ? ret : NULL;
+}
+
+// The fill level is sampled every FILL_SAMPLE pushes and whenever a
+// pusher finds the fifo full
+static int mpmc_max_fill(struct fifo *fifo)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+
+    return __atomic_exchange_n(&f->max_fill, 0, __ATOMIC_RELAXED);
+}
+
+static void mpmc_counts(struct fifo *fifo, uint64_t *pushes, uint64_t *pops)
+{
+    struct fifo_mpmc *f = to_mpmc(fifo);
+
+    *pops = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+    *pushes = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+}
+
+static const struct fifo_ops mpmc_ops = {
+    .free = mpmc_free,
+    .open = mpmc_open,
+    .close = mpmc_close,
+    .push = mpmc_push,
+    .pop = mpmc_pop,
+    .push_n = mpmc_push_n,
+    .pop_n = mpmc_pop_n,
+    .reserve = fifo_unsupported_reserve,
+    .commit = fifo_unsupported_commit,
+    .peek = fifo_unsupported_peek,
+    .release = fifo_unsupported_release,
+    .max_fill = mpmc_max_fill,
+    .counts = mpmc_counts,
+};
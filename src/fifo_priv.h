@@ -0,0 +1,317 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Internal interface shared by the fifo implementations
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef FIFO_PRIV_H
+#define FIFO_PRIV_H
+
+#include "fifo.h"
+#include "utils.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+// Deadlines for the push_n and pop_n ops, in utils_monotonic_ns() time
+#define FIFO_NOWAIT  0
+#define FIFO_FOREVER UINT64_MAX
+
+// Each variant fills in one of these; the public fifo_* calls dispatch
+// through it so callers don't care which kind of fifo they were given.
+struct fifo_ops {
+    void (*free)(struct fifo *f);
+    void (*open)(struct fifo *f);
+    void (*close)(struct fifo *f);
+    void (*push)(struct fifo *f, void *x);
+    void *(*pop)(struct fifo *f);
+
+    // Push returns how many were pushed before the deadline. Pop
+    // returns how many were popped, 0 at end of stream or -1 if the
+    // deadline passed first.
+    size_t (*push_n)(struct fifo *f, void **x, size_t n, uint64_t deadline);
+    int (*pop_n)(struct fifo *f, void **x, size_t n, uint64_t deadline);
+
+    // Only record fifos implement these, and they don't implement the
+    // pointer based calls above; either side fills the gaps with the
+    // fifo_unsupported_* stubs. Reserve returns NULL if the deadline
+    // passed first and peek returns like pop_n does for one record.
+    void *(*reserve)(struct fifo *f, uint64_t deadline);
+    void (*commit)(struct fifo *f, void *rec);
+    int (*peek)(struct fifo *f, const void **rec, uint64_t deadline);
+    void (*release)(struct fifo *f, const void *rec);
+
+    int (*max_fill)(struct fifo *f);
+
+    // Totals for fifo_stats(); they may be slightly out of step with
+    // each other while the fifo is in use
+    void (*counts)(struct fifo *f, uint64_t *pushes, uint64_t *pops);
+};
+
+// Calls that don't apply to a fifo's kind fail an assertion, or set
+// errno to EINVAL and fail as far as the call allows where assertions
+// are compiled out: pops and peeks then look like the end of the stream
+void fifo_unsupported_push(struct fifo *f, void *x);
+void *fifo_unsupported_pop(struct fifo *f);
+size_t fifo_unsupported_push_n(struct fifo *f, void **x, size_t n,
+                               uint64_t deadline);
+int fifo_unsupported_pop_n(struct fifo *f, void **x, size_t n,
+                           uint64_t deadline);
+void *fifo_unsupported_reserve(struct fifo *f, uint64_t deadline);
+void fifo_unsupported_commit(struct fifo *f, void *rec);
+int fifo_unsupported_peek(struct fifo *f, const void **rec,
+                          uint64_t deadline);
+void fifo_unsupported_release(struct fifo *f, const void *rec);
+
+// Calls to fifo_push_n() or fifo_pop_n() and the items they moved.
+// Each variant keeps these next to the rest of that side's state.
+struct fifo_batch_count {
+    unsigned long calls, items;
+    int max;
+};
+
+struct fifo_wait_count {
+    uint64_t waits, ns;
+};
+
+// Kept by each variant somewhere only the slow paths write. Occupancy
+// is sampled at most once per clock tick, by whichever operation first
+// notices the tick, and the time since the last sample is charged to
+// the fill level the fifo had up to that operation.
+struct fifo_telemetry {
+    uint64_t start_ns;
+    uint64_t sample_ns;
+    struct fifo_wait_count full, empty;
+    uint64_t occupancy_ns[FIFO_OCCUPANCY_BUCKETS];
+};
+
+// Embedded at the start of every variant's own structure
+struct fifo {
+    const struct fifo_ops *ops;
+    uint64_t capacity;
+    struct fifo_batch_count *push_batch, *pop_batch;
+    struct fifo_telemetry *tel;
+    int event_fd[2];
+};
+
+static inline void fifo_init(struct fifo *f, const struct fifo_ops *ops,
+                             uint64_t capacity,
+                             struct fifo_batch_count *push_batch,
+                             struct fifo_batch_count *pop_batch,
+                             struct fifo_telemetry *tel)
+{
+    f->ops = ops;
+    f->capacity = capacity;
+    f->push_batch = push_batch;
+    f->pop_batch = pop_batch;
+    f->tel = tel;
+    f->event_fd[FIFO_EVENT_READABLE] = -1;
+    f->event_fd[FIFO_EVENT_WRITABLE] = -1;
+
+    *tel = (struct fifo_telemetry){};
+    tel->start_ns = tel->sample_ns = utils_monotonic_coarse_ns();
+}
+
+static inline int fifo_occupancy_bucket(uint64_t fill, uint64_t capacity)
+{
+    if (!fill)
+        return 0;
+    if (fill >= capacity)
+        return FIFO_OCCUPANCY_BUCKETS - 1;
+
+    return 1 + (fill - 1) * (FIFO_OCCUPANCY_BUCKETS - 2) / (capacity - 1);
+}
+
+// Returns the time to charge to the current fill level if this caller
+// is the one to take the sample for a new clock tick, otherwise 0
+static inline uint64_t fifo_sample_due(struct fifo *f)
+{
+    uint64_t now = utils_monotonic_coarse_ns();
+    uint64_t last = __atomic_load_n(&f->tel->sample_ns, __ATOMIC_RELAXED);
+
+    if (now <= last ||
+        !__atomic_compare_exchange_n(&f->tel->sample_ns, &last, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return 0;
+
+    return now - last;
+}
+
+static inline void fifo_sample(struct fifo *f, uint64_t dt, uint64_t fill)
+{
+    int bucket = fifo_occupancy_bucket(fill, f->capacity);
+
+    __atomic_add_fetch(&f->tel->occupancy_ns[bucket], dt, __ATOMIC_RELAXED);
+}
+
+static inline void fifo_count_wait(struct fifo_wait_count *c,
+                                   uint64_t start_ns)
+{
+    __atomic_add_fetch(&c->waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->ns, utils_monotonic_ns() - start_ns,
+                       __ATOMIC_RELAXED);
+}
+
+// Makes a fifo's eventfd readable, if it has one
+static inline void fifo_signal(struct fifo *f, enum fifo_event ev)
+{
+    uint64_t one = 1;
+
+    if (f->event_fd[ev] >= 0) {
+        ssize_t ret = write(f->event_fd[ev], &one, sizeof(one));
+        (void) ret;
+    }
+}
+
+// Whether a waiter has run out of time
+static inline int fifo_expired(uint64_t deadline)
+{
+    return deadline != FIFO_FOREVER && utils_monotonic_ns() >= deadline;
+}
+
+static inline int fifo_is_power_of_two(size_t x)
+{
+    return x && (x & (x-1)) == 0;
+}
+
+// How long a blocked side spins before sleeping. Spinning only helps
+// when the other side can run at the same time.
+#define FIFO_SPIN_LOOPS 100
+
+static inline int fifo_spin_loops(void)
+{
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? FIFO_SPIN_LOOPS : 0;
+}
+
+// Threads blocked on one side of a fifo. A sleeper arms the waitq
+// before its final look at the fifo and a waker checks it after
+// changing the fifo, so one of the two always sees the other.
+//
+// Each waker only wakes one sleeper and only the first waker to see the
+// waitq armed makes the syscall. A sleeper passes the wake up on to the
+// next one when it is done waiting, so a burst of pushes doesn't
+// stampede every blocked thread and nobody is left sleeping on a fifo
+// that has work for them.
+//
+// A thread that won't sleep but watches the fifo's eventfd arms the
+// waitq the same way, so the eventfd is only signalled once per time
+// somebody found the fifo empty or full.
+struct fifo_waitq {
+    uint32_t seq;
+    int armed;
+    int sleepers;
+};
+
+// Returns the value to hand to fifo_wait_sleep(); first is set on the
+// first call of each wait
+static inline uint32_t fifo_wait_arm(struct fifo_waitq *w, int first)
+{
+    uint32_t seq = __atomic_load_n(&w->seq, __ATOMIC_ACQUIRE);
+
+    if (first)
+        __atomic_add_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&w->armed, 1, __ATOMIC_SEQ_CST);
+
+    return seq;
+}
+
+static inline void fifo_wait_arm_event(struct fifo_waitq *w)
+{
+    __atomic_store_n(&w->armed, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void fifo_wait_sleep(struct fifo_waitq *w, uint32_t seq,
+                                   uint64_t deadline)
+{
+    struct timespec ts, *timeout = NULL;
+
+    if (deadline != FIFO_FOREVER) {
+        uint64_t now = utils_monotonic_ns();
+        if (now >= deadline)
+            return;
+
+        ts.tv_sec = (deadline - now) / 1000000000;
+        ts.tv_nsec = (deadline - now) % 1000000000;
+        timeout = &ts;
+    }
+
+    syscall(SYS_futex, &w->seq, FUTEX_WAIT_PRIVATE, seq, timeout, NULL, 0);
+}
+
+static inline void fifo_wake_n(struct fifo_waitq *w, int count)
+{
+    __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &w->seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Called once by a thread that armed the waitq when it stops waiting.
+// The waitq is left armed as an eventfd user may still be counting
+// on it.
+static inline void fifo_wait_done(struct fifo_waitq *w)
+{
+    if (__atomic_sub_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST))
+        fifo_wake_n(w, 1);
+}
+
+static inline void fifo_wake(struct fifo *f, struct fifo_waitq *w,
+                             enum fifo_event ev)
+{
+    if (!__atomic_load_n(&w->armed, __ATOMIC_SEQ_CST) ||
+        !__atomic_exchange_n(&w->armed, 0, __ATOMIC_SEQ_CST))
+        return;
+
+    fifo_signal(f, ev);
+
+    if (__atomic_load_n(&w->sleepers, __ATOMIC_SEQ_CST))
+        fifo_wake_n(w, 1);
+}
+
+// Used on close, where every sleeper needs to see the end of the fifo
+static inline void fifo_wake_all(struct fifo *f, struct fifo_waitq *w)
+{
+    fifo_signal(f, FIFO_EVENT_READABLE);
+
+    if (__atomic_load_n(&w->sleepers, __ATOMIC_SEQ_CST))
+        fifo_wake_n(w, INT_MAX);
+}
+
+// Raise *max to at least val
+static inline void fifo_update_max(int *max, int val)
+{
+    int cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (val > cur &&
+           !__atomic_compare_exchange_n(max, &cur, val, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+}
+
+static inline void fifo_batch_add(struct fifo_batch_count *c, size_t n)
+{
+    __atomic_add_fetch(&c->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->items, n, __ATOMIC_RELAXED);
+    fifo_update_max(&c->max, n);
+}
+
+#endif
@@ -0,0 +1,399 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Lock-free bounded fifo of fixed size records held in the ring
+//
+//     Works like the MPMC fifo, except each slot holds the record
+//     itself rather than a pointer to it, so small descriptors pass
+//     between threads without being allocated and freed. A producer
+//     claims a slot and fills it in place before publishing it by
+//     bumping the slot's sequence number; a consumer claims a published
+//     slot and reads it in place before handing it back the same way.
+//     Slots are sized so none straddles a cache line boundary unless
+//     it is bigger than a line.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "fifo_priv.h"
+#include "capi.h"
+#include "macro.h"
+#include "trace.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+// The reserve side reads the pop index to sample the fill level only
+// once every this many reserves
+#define FILL_SAMPLE 64
+
+struct slot {
+    uint64_t seq;
+    char rec[];
+};
+
+struct fifo_rec {
+    struct fifo fifo;
+
+    char *ring;
+    size_t stride;
+    uint32_t mask;
+    int spin;
+
+    uint64_t tail __cacheline_aligned;
+    struct fifo_batch_count push_batch;
+
+    uint64_t head __cacheline_aligned;
+    struct fifo_batch_count pop_batch;
+
+    // Only written by threads that have to sleep, on open and close and
+    // when a new maximum fill is seen
+    int readers __cacheline_aligned;
+    int max_fill;
+    struct fifo_waitq push_wait, pop_wait;
+    struct fifo_telemetry tel;
+};
+
+static const struct fifo_ops rec_ops;
+
+static inline struct fifo_rec *to_rec(struct fifo *f)
+{
+    return container_of(f, struct fifo_rec, fifo);
+}
+
+static inline struct slot *get_slot(struct fifo_rec *f, uint64_t pos)
+{
+    return (struct slot *) (f->ring + (pos & f->mask) * f->stride);
+}
+
+static inline struct slot *rec_slot(const void *rec)
+{
+    return container_of((void *) rec, struct slot, rec);
+}
+
+// Called before claiming a slot
+static inline void sample(struct fifo_rec *f)
+{
+    uint64_t dt = fifo_sample_due(&f->fifo);
+
+    if (dt)
+        fifo_sample(&f->fifo, dt,
+                    __atomic_load_n(&f->tail, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&f->head, __ATOMIC_RELAXED));
+}
+
+// Smallest power of two that holds the slot up to a cache line, whole
+// cache lines after that
+static size_t slot_stride(size_t rec_size)
+{
+    size_t len = sizeof(struct slot) + rec_size;
+    size_t stride = sizeof(struct slot);
+
+    if (len > CAPI_CACHELINE_BYTES)
+        return (len + CAPI_CACHELINE_BYTES - 1) &
+            ~(size_t) (CAPI_CACHELINE_BYTES - 1);
+
+    while (stride < len)
+        stride *= 2;
+
+    return stride;
+}
+
+struct fifo *fifo_rec_new(size_t entries, size_t rec_size)
+{
+    if (!fifo_is_power_of_two(entries) || entries < 2 ||
+        entries > (1U << 31) || !rec_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct fifo_rec *f = capi_alloc(sizeof(*f));
+    if (f == NULL)
+        return NULL;
+
+    memset(f, 0, sizeof(*f));
+
+    f->stride = slot_stride(rec_size);
+    f->ring = capi_alloc(f->stride * entries);
+    if (f->ring == NULL)
+        goto error_free;
+
+    f->mask = entries - 1;
+    for (uint32_t i = 0; i < entries; i++)
+        get_slot(f, i)->seq = i;
+
+    fifo_init(&f->fifo, &rec_ops, entries, &f->push_batch, &f->pop_batch,
+              &f->tel);
+    f->spin = fifo_spin_loops();
+
+    return &f->fifo;
+
+error_free:
+    free(f);
+    return NULL;
+}
+
+static void rec_free(struct fifo *fifo)
+{
+    struct fifo_rec *f = to_rec(fifo);
+
+    free(f->ring);
+    free(f);
+}
+
+static void rec_open(struct fifo *fifo)
+{
+    struct fifo_rec *f = to_rec(fifo);
+
+    __atomic_add_fetch(&f->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void rec_close(struct fifo *fifo)
+{
+    struct fifo_rec *f = to_rec(fifo);
+
+    __atomic_sub_fetch(&f->readers, 1, __ATOMIC_SEQ_CST);
+    fifo_wake_all(fifo, &f->pop_wait);
+}
+
+// Claims the next position on one side of the ring once its slot's
+// sequence number reaches pos + ready. Returns the slot or NULL if it
+// isn't ready yet.
+static struct slot *claim(struct fifo_rec *f, uint64_t *index,
+                          uint64_t ready)
+{
+    uint64_t pos = __atomic_load_n(index, __ATOMIC_RELAXED);
+
+    for (;;) {
+        struct slot *s = get_slot(f, pos);
+        int64_t dif = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) -
+            (pos + ready);
+
+        if (dif < 0)
+            return NULL;
+
+        if (dif > 0) {
+            pos = __atomic_load_n(index, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(index, &pos, pos + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return s;
+    }
+}
+
+// Spin for a while, then sleep on the waitq until a slot can be claimed
+// or the deadline passes
+static struct slot *wait_reserve(struct fifo_rec *f, uint64_t deadline)
+{
+    struct slot *s;
+
+    fifo_update_max(&f->max_fill, f->mask + 1);
+
+    if (deadline == FIFO_NOWAIT) {
+        fifo_wait_arm_event(&f->push_wait);
+        return claim(f, &f->tail, 0);
+    }
+
+    uint64_t wait_start = utils_monotonic_ns();
+
+    int i;
+    for (i = 0; ; i++) {
+        uint32_t seq = 0;
+
+        if (i >= f->spin)
+            seq = fifo_wait_arm(&f->push_wait, i == f->spin);
+
+        s = claim(f, &f->tail, 0);
+        if (s != NULL || fifo_expired(deadline))
+            break;
+
+        if (i < f->spin)
+            cpu_relax();
+        else
+            fifo_wait_sleep(&f->push_wait, seq, deadline);
+    }
+
+    if (i >= f->spin)
+        fifo_wait_done(&f->push_wait);
+
+    fifo_count_wait(&f->tel.full, wait_start);
+    trace_span("fifo full", wait_start, (uintptr_t) f);
+
+    return s;
+}
+
+// Returns 1 with the claimed slot in *s, 0 if the fifo is empty and no
+// longer open or -1 if it is just empty
+static int try_claim_peek(struct fifo_rec *f, struct slot **s)
+{
+    *s = claim(f, &f->head, 1);
+    if (*s != NULL)
+        return 1;
+
+    if (__atomic_load_n(&f->readers, __ATOMIC_SEQ_CST))
+        return -1;
+
+    // Anything committed before the last close is visible once the
+    // close is, so a second look settles whether we're finished
+    *s = claim(f, &f->head, 1);
+    return *s != NULL;
+}
+
+static int wait_peek(struct fifo_rec *f, struct slot **s, uint64_t deadline)
+{
+    int ret;
+
+    if (deadline == FIFO_NOWAIT) {
+        fifo_wait_arm_event(&f->pop_wait);
+        return try_claim_peek(f, s);
+    }
+
+    uint64_t wait_start = utils_monotonic_ns();
+
+    int i;
+    for (i = 0; ; i++) {
+        uint32_t seq = 0;
+
+        if (i >= f->spin)
+            seq = fifo_wait_arm(&f->pop_wait, i == f->spin);
+
+        ret = try_claim_peek(f, s);
+        if (ret >= 0 || fifo_expired(deadline))
+            break;
+
+        if (i < f->spin)
+            cpu_relax();
+        else
+            fifo_wait_sleep(&f->pop_wait, seq, deadline);
+    }
+
+    if (i >= f->spin)
+        fifo_wait_done(&f->pop_wait);
+
+    if (ret > 0)
+        fifo_count_wait(&f->tel.empty, wait_start);
+    trace_span("fifo empty", wait_start, (uintptr_t) f);
+
+    return ret;
+}
+
+static void *rec_reserve(struct fifo *fifo, uint64_t deadline)
+{
+    struct fifo_rec *f = to_rec(fifo);
+
+    sample(f);
+
+    struct slot *s = claim(f, &f->tail, 0);
+    if (s == NULL)
+        s = wait_reserve(f, deadline);
+    if (s == NULL)
+        return NULL;
+
+    // The slot's sequence number is its position until it's committed
+    uint64_t pos = s->seq;
+    if (!(pos & (FILL_SAMPLE - 1)) || trace_enabled()) {
+        int fill = pos + 1 - __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+        fifo_update_max(&f->max_fill, fill);
+        trace_instant("fifo push", fill);
+    }
+
+    return s->rec;
+}
+
+static void rec_commit(struct fifo *fifo, void *rec)
+{
+    struct fifo_rec *f = to_rec(fifo);
+    struct slot *s = rec_slot(rec);
+
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_SEQ_CST);
+    fifo_wake(fifo, &f->pop_wait, FIFO_EVENT_READABLE);
+}
+
+static int rec_peek(struct fifo *fifo, const void **rec,
+                    uint64_t deadline)
+{
+    struct fifo_rec *f = to_rec(fifo);
+    struct slot *s;
+
+    sample(f);
+
+    s = claim(f, &f->head, 1);
+    if (s == NULL) {
+        int ret = wait_peek(f, &s, deadline);
+        if (ret <= 0)
+            return ret;
+    }
+
+    if (trace_enabled())
+        trace_instant("fifo pop", __atomic_load_n(&f->tail, __ATOMIC_RELAXED) -
+                      s->seq);
+
+    *rec = s->rec;
+    return 1;
+}
+
+// A committed slot's sequence number is its position plus one; once
+// released it's ready for the producers' next lap
+static void rec_release(struct fifo *fifo, const void *rec)
+{
+    struct fifo_rec *f = to_rec(fifo);
+    struct slot *s = rec_slot(rec);
+
+    __atomic_store_n(&s->seq, s->seq + f->mask, __ATOMIC_SEQ_CST);
+    fifo_wake(fifo, &f->push_wait, FIFO_EVENT_WRITABLE);
+}
+
+// The fill level is sampled every FILL_SAMPLE reserves and whenever a
+// producer finds the fifo full
+static int rec_max_fill(struct fifo *fifo)
+{
+    struct fifo_rec *f = to_rec(fifo);
+
+    return __atomic_exchange_n(&f->max_fill, 0, __ATOMIC_RELAXED);
+}
+
+// Counts slots claimed on each side, whether or not they have been
+// committed or released yet
+static void rec_counts(struct fifo *fifo, uint64_t *pushes, uint64_t *pops)
+{
+    struct fifo_rec *f = to_rec(fifo);
+
+    *pops = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+    *pushes = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+}
+
+static const struct fifo_ops rec_ops = {
+    .free = rec_free,
+    .open = rec_open,
+    .close = rec_close,
+    .push = fifo_unsupported_push,
+    .pop = fifo_unsupported_pop,
+    .push_n = fifo_unsupported_push_n,
+    .pop_n = fifo_unsupported_pop_n,
+    .reserve = rec_reserve,
+    .commit = rec_commit,
+    .peek = rec_peek,
+    .release = rec_release,
+    .max_fill = rec_max_fill,
+    .counts = rec_counts,
+};
@@ -0,0 +1,389 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Lock-free single producer, single consumer fifo
+//
+//     Each side owns its index on its own cache line and keeps a cached
+//     copy of the other side's, so it only reads the other line when
+//     the fifo looks full or empty. A side that finds it really is full
+//     or empty spins briefly and then sleeps on a futex; the other side
+//     only makes the wake up syscall when it sees someone is sleeping.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "fifo_priv.h"
+#include "capi.h"
+#include "macro.h"
+#include "trace.h"
+
+#include <string.h>
+#include <errno.h>
+
+struct fifo_spsc {
+    struct fifo fifo;
+
+    void **queue;
+    uint32_t mask;
+    int spin;
+
+    // Producer side
+    uint64_t tail __cacheline_aligned;
+    uint64_t cached_head;
+    struct fifo_batch_count push_batch;
+
+    // Consumer side
+    uint64_t head __cacheline_aligned;
+    uint64_t cached_tail;
+    struct fifo_batch_count pop_batch;
+
+    // Only written when a side has to sleep, on open and close and
+    // when a new maximum fill is seen
+    int readers __cacheline_aligned;
+    int max_fill;
+    struct fifo_waitq push_wait, pop_wait;
+    struct fifo_telemetry tel;
+};
+
+static const struct fifo_ops spsc_ops;
+
+// Called before each change to the fifo
+static inline void sample(struct fifo_spsc *f)
+{
+    uint64_t dt = fifo_sample_due(&f->fifo);
+
+    if (dt)
+        fifo_sample(&f->fifo, dt,
+                    __atomic_load_n(&f->tail, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&f->head, __ATOMIC_RELAXED));
+}
+
+static inline struct fifo_spsc *to_spsc(struct fifo *f)
+{
+    return container_of(f, struct fifo_spsc, fifo);
+}
+
+struct fifo *fifo_spsc_new(size_t entries)
+{
+    if (!fifo_is_power_of_two(entries) || entries > (1U << 31)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct fifo_spsc *f = capi_alloc(sizeof(*f));
+    if (f == NULL)
+        return NULL;
+
+    memset(f, 0, sizeof(*f));
+
+    f->queue = malloc(sizeof(*f->queue) * entries);
+    if (f->queue == NULL)
+        goto error_free;
+
+    fifo_init(&f->fifo, &spsc_ops, entries, &f->push_batch, &f->pop_batch,
+              &f->tel);
+    f->mask = entries - 1;
+    f->spin = fifo_spin_loops();
+
+    return &f->fifo;
+
+error_free:
+    free(f);
+    return NULL;
+}
+
+static void spsc_free(struct fifo *fifo)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+
+    free(f->queue);
+    free(f);
+}
+
+static void spsc_open(struct fifo *fifo)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+
+    __atomic_add_fetch(&f->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void spsc_close(struct fifo *fifo)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+
+    __atomic_sub_fetch(&f->readers, 1, __ATOMIC_SEQ_CST);
+    fifo_wake_all(fifo, &f->pop_wait);
+}
+
+static int has_room(struct fifo_spsc *f, uint64_t tail)
+{
+    f->cached_head = __atomic_load_n(&f->head, __ATOMIC_SEQ_CST);
+    return tail - f->cached_head <= f->mask;
+}
+
+// Spin for a while, then sleep on the waitq until the consumer frees a
+// slot. Returns 0 if the deadline passed first.
+static int wait_not_full(struct fifo_spsc *f, uint64_t tail,
+                         uint64_t deadline)
+{
+    int ret;
+
+    if (deadline == FIFO_NOWAIT) {
+        fifo_wait_arm_event(&f->push_wait);
+        return has_room(f, tail);
+    }
+
+    uint64_t wait_start = utils_monotonic_ns();
+
+    int i;
+    for (i = 0; ; i++) {
+        uint32_t seq = 0;
+
+        if (i >= f->spin)
+            seq = fifo_wait_arm(&f->push_wait, i == f->spin);
+
+        ret = has_room(f, tail);
+        if (ret || fifo_expired(deadline))
+            break;
+
+        if (i < f->spin)
+            cpu_relax();
+        else
+            fifo_wait_sleep(&f->push_wait, seq, deadline);
+    }
+
+    if (i >= f->spin)
+        fifo_wait_done(&f->push_wait);
+
+    fifo_count_wait(&f->tel.full, wait_start);
+    trace_span("fifo full", wait_start, (uintptr_t) f);
+
+    return ret;
+}
+
+// Returns 1 if there are items, 0 if the fifo is empty and no longer
+// open or -1 if it is just empty
+static int has_items(struct fifo_spsc *f, uint64_t head)
+{
+    f->cached_tail = __atomic_load_n(&f->tail, __ATOMIC_SEQ_CST);
+    if (f->cached_tail != head)
+        return 1;
+
+    if (__atomic_load_n(&f->readers, __ATOMIC_SEQ_CST))
+        return -1;
+
+    // Anything pushed before the last close is visible now
+    f->cached_tail = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+    return f->cached_tail != head;
+}
+
+static int wait_not_empty(struct fifo_spsc *f, uint64_t head,
+                          uint64_t deadline)
+{
+    int ret;
+
+    if (deadline == FIFO_NOWAIT) {
+        fifo_wait_arm_event(&f->pop_wait);
+        return has_items(f, head);
+    }
+
+    uint64_t wait_start = utils_monotonic_ns();
+
+    int i;
+    for (i = 0; ; i++) {
+        uint32_t seq = 0;
+
+        if (i >= f->spin)
+            seq = fifo_wait_arm(&f->pop_wait, i == f->spin);
+
+        ret = has_items(f, head);
+        if (ret >= 0 || fifo_expired(deadline))
+            break;
+
+        if (i < f->spin)
+            cpu_relax();
+        else
+            fifo_wait_sleep(&f->pop_wait, seq, deadline);
+    }
+
+    if (i >= f->spin)
+        fifo_wait_done(&f->pop_wait);
+
+    if (ret > 0)
+        fifo_count_wait(&f->tel.empty, wait_start);
+    trace_span("fifo empty", wait_start, (uintptr_t) f);
+
+    return ret;
+}
+
+static void spsc_push(struct fifo *fifo, void *x)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+    uint64_t tail = __atomic_load_n(&f->tail, __ATOMIC_RELAXED);
+
+    if (tail - f->cached_head > f->mask) {
+        f->cached_head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+        fifo_update_max(&f->max_fill, tail - f->cached_head);
+
+        if (tail - f->cached_head > f->mask)
+            wait_not_full(f, tail, FIFO_FOREVER);
+    }
+
+    sample(f);
+
+    f->queue[tail & f->mask] = x;
+    __atomic_store_n(&f->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    fifo_wake(fifo, &f->pop_wait, FIFO_EVENT_READABLE);
+
+    trace_instant("fifo push", tail + 1 - f->cached_head);
+}
+
+static void *spsc_pop(struct fifo *fifo)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+    uint64_t head = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+
+    if (head == f->cached_tail) {
+        f->cached_tail = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+        fifo_update_max(&f->max_fill, f->cached_tail - head);
+
+        if (head == f->cached_tail &&
+            wait_not_empty(f, head, FIFO_FOREVER) <= 0)
+            return NULL;
+    }
+
+    sample(f);
+
+    void *ret = f->queue[head & f->mask];
+    __atomic_store_n(&f->head, head + 1, __ATOMIC_SEQ_CST);
+
+    fifo_wake(fifo, &f->push_wait, FIFO_EVENT_WRITABLE);
+
+    trace_instant("fifo pop", f->cached_tail - head - 1);
+
+    return ret;
+}
+
+static size_t spsc_push_n(struct fifo *fifo, void **x, size_t n,
+                          uint64_t deadline)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+    uint64_t tail = __atomic_load_n(&f->tail, __ATOMIC_RELAXED);
+    size_t pushed = 0;
+
+    while (pushed < n) {
+        uint64_t room = f->mask + 1 - (tail - f->cached_head);
+
+        if (room < n - pushed) {
+            f->cached_head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+            fifo_update_max(&f->max_fill, tail - f->cached_head);
+
+            if (tail - f->cached_head > f->mask &&
+                !wait_not_full(f, tail, deadline))
+                break;
+
+            room = f->mask + 1 - (tail - f->cached_head);
+        }
+
+        sample(f);
+
+        size_t count = room < n - pushed ? room : n - pushed;
+        for (size_t i = 0; i < count; i++)
+            f->queue[(tail + i) & f->mask] = x[pushed + i];
+
+        tail += count;
+        pushed += count;
+
+        __atomic_store_n(&f->tail, tail, __ATOMIC_SEQ_CST);
+        fifo_wake(fifo, &f->pop_wait, FIFO_EVENT_READABLE);
+
+        trace_instant("fifo push", tail - f->cached_head);
+    }
+
+    return pushed;
+}
+
+static int spsc_pop_n(struct fifo *fifo, void **x, size_t n,
+                      uint64_t deadline)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+    uint64_t head = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+
+    if (f->cached_tail - head < n) {
+        f->cached_tail = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+        fifo_update_max(&f->max_fill, f->cached_tail - head);
+
+        if (head == f->cached_tail) {
+            int ret = wait_not_empty(f, head, deadline);
+            if (ret <= 0)
+                return ret;
+        }
+    }
+
+    sample(f);
+
+    size_t count = f->cached_tail - head;
+    if (count > n)
+        count = n;
+
+    for (size_t i = 0; i < count; i++)
+        x[i] = f->queue[(head + i) & f->mask];
+
+    __atomic_store_n(&f->head, head + count, __ATOMIC_SEQ_CST);
+    fifo_wake(fifo, &f->push_wait, FIFO_EVENT_WRITABLE);
+
+    trace_instant("fifo pop", f->cached_tail - head - count);
+
+    return count;
+}
+
+// The fill level is sampled whenever either side has to refresh its
+// copy of the other's index, which is always the case when the fifo
+// runs full or empty.
+static int spsc_max_fill(struct fifo *fifo)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+
+    return __atomic_exchange_n(&f->max_fill, 0, __ATOMIC_RELAXED);
+}
+
+static void spsc_counts(struct fifo *fifo, uint64_t *pushes, uint64_t *pops)
+{
+    struct fifo_spsc *f = to_spsc(fifo);
+
+    *pops = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+    *pushes = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+}
+
+static const struct fifo_ops spsc_ops = {
+    .free = spsc_free,
+    .open = spsc_open,
+    .close = spsc_close,
+    .push = spsc_push,
+    .pop = spsc_pop,
+    .push_n = spsc_push_n,
+    .pop_n = spsc_pop_n,
+    .reserve = fifo_unsupported_reserve,
+    .commit = fifo_unsupported_commit,
+    .peek = fifo_unsupported_peek,
+    .release = fifo_unsupported_release,
+    .max_fill = spsc_max_fill,
+    .counts = spsc_counts,
+};
@@ -0,0 +1,190 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Lock-free log-linear (HDR style) histogram
+//
+//     Each power of two is split into HIST_SUB linear buckets so every
+//     value is recorded with better than 1/HIST_SUB relative precision.
+//     Recording is a handful of relaxed atomic operations so it can be
+//     called from any number of threads on the fast path.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "hist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    HIST_SUB_BITS = 4,
+    HIST_SUB = 1 << HIST_SUB_BITS,
+    HIST_BUCKETS = (64 - HIST_SUB_BITS + 1) * HIST_SUB,
+};
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static unsigned bucket_idx(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+
+    unsigned e = 63 - __builtin_clzll(v);
+    unsigned sub = (v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1);
+
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+static uint64_t bucket_low(unsigned idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+
+    unsigned e = idx / HIST_SUB - 1 + HIST_SUB_BITS;
+    uint64_t sub = idx % HIST_SUB;
+
+    return (HIST_SUB + sub) << (e - HIST_SUB_BITS);
+}
+
+static uint64_t bucket_width(unsigned idx)
+{
+    if (idx < HIST_SUB)
+        return 1;
+
+    return 1ULL << (idx / HIST_SUB - 1);
+}
+
+struct hist *hist_new(void)
+{
+    struct hist *h = malloc(sizeof(*h));
+    if (h == NULL)
+        return NULL;
+
+    hist_reset(h);
+
+    return h;
+}
+
+void hist_free(struct hist *h)
+{
+    free(h);
+}
+
+// Not atomic with respect to concurrent hist_record() calls; values
+// recorded during a reset may be partially lost.
+void hist_reset(struct hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+    __atomic_fetch_add(&h->buckets[bucket_idx(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value < cur &&
+           !__atomic_compare_exchange_n(&h->min, &cur, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(&h->max, &cur, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t hist_count(struct hist *h)
+{
+    return __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+}
+
+uint64_t hist_min(struct hist *h)
+{
+    uint64_t ret = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    return ret == UINT64_MAX ? 0 : ret;
+}
+
+uint64_t hist_max(struct hist *h)
+{
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+double hist_mean(struct hist *h)
+{
+    uint64_t count = hist_count(h);
+    if (!count)
+        return 0;
+
+    return (double) __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count;
+}
+
+// Returns the midpoint of the bucket holding the pct'th percentile
+// (0 < pct <= 100), clamped to the recorded min and max.
+uint64_t hist_percentile(struct hist *h, double pct)
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+    if (!total)
+        return 0;
+
+    uint64_t target = pct / 100 * total + 0.5;
+    if (target < 1)
+        target = 1;
+    if (target > total)
+        target = total;
+
+    uint64_t seen = 0;
+    unsigned i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target)
+            break;
+    }
+
+    uint64_t ret = bucket_low(i) + bucket_width(i) / 2;
+
+    if (ret < hist_min(h))
+        ret = hist_min(h);
+    if (ret > hist_max(h))
+        ret = hist_max(h);
+
+    return ret;
+}
+
+void hist_dump(struct hist *h, FILE *out, const char *name)
+{
+    fprintf(out, "%-10s count %-10llu mean %-10.1f min %-8llu p50 %-8llu "
+            "p90 %-8llu p99 %-8llu p99.9 %-8llu max %llu\n", name,
+            (unsigned long long) hist_count(h), hist_mean(h),
+            (unsigned long long) hist_min(h),
+            (unsigned long long) hist_percentile(h, 50),
+            (unsigned long long) hist_percentile(h, 90),
+            (unsigned long long) hist_percentile(h, 99),
+            (unsigned long long) hist_percentile(h, 99.9),
+            (unsigned long long) hist_max(h));
+}
@@ -0,0 +1,729 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     File streaming pipeline: reader -> submitter -> wqueue ->
+//     harvester -> writer, each stage a worker thread group connected
+//     by fifos.
+//
+//     A fixed set of max_inflight buffers circulates through the stages
+//     (readers take them from free_bufs and writers give them back) so
+//     the number of chunks in flight is capped and nothing is allocated
+//     once the pipeline is running. Every chunk carries its file offset
+//     so with seekable files the stages may run any number of threads
+//     and chunks are written back with pwrite in whatever order they
+//     complete. If the output can't seek every stage is limited to one
+//     thread to keep the chunks in order.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "pipeline.h"
+#include "wqueue.h"
+#include "worker.h"
+#include "fifo.h"
+#include "capi.h"
+#include "macro.h"
+#include "utils.h"
+#include "topo.h"
+#include "trace.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+
+struct pipeline_buf {
+    void *data;
+    size_t len;
+    off_t offset;
+};
+
+struct stage {
+    struct worker worker;
+    const char *name;
+    int threads;
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t end_ns;
+    int remote;
+};
+
+struct pipeline {
+    struct wqueue *wq;
+    int in_fd, out_fd;
+    int in_seekable, out_seekable;
+    struct pipeline_opts opts;
+
+    struct pipeline_buf *bufs;
+    struct capi_mem buf_mem;
+    void *eos;
+
+    struct fifo *free_bufs;
+    struct fifo *to_submit;
+    struct fifo *to_write;
+
+    pthread_mutex_t read_mutex;
+    off_t read_offset;
+    int submitters_left;
+    int errors;
+    int readers_stopped;
+    uint64_t start_ns;
+    int ran;
+
+    struct stage reader, submitter, harvester, writer;
+};
+
+void pipeline_default_opts(struct pipeline_opts *opts)
+{
+    opts->readers = 1;
+    opts->submitters = 1;
+    opts->harvesters = 1;
+    opts->writers = 1;
+    opts->chunk_size = 1 << 20;
+    opts->max_inflight = 64;
+    opts->backing = CAPI_BACKING_NORMAL;
+    opts->node = -1;
+    opts->wait_forever = 0;
+}
+
+static size_t fifo_entries(size_t n)
+{
+    size_t ret = 2;
+
+    while (ret < n)
+        ret <<= 1;
+
+    return ret;
+}
+
+// A fifo with a single thread on each side can use the cheaper SPSC
+// variant
+static struct fifo *stage_fifo(size_t entries, int pushers, int poppers)
+{
+    if (pushers == 1 && poppers == 1)
+        return fifo_spsc_new(entries);
+
+    return fifo_mpmc_new(entries);
+}
+
+static int is_seekable(int fd)
+{
+    return fd >= 0 && lseek(fd, 0, SEEK_CUR) != (off_t) -1;
+}
+
+struct pipeline *pipeline_new(struct wqueue *wq, int in_fd, int out_fd,
+                              const struct pipeline_opts *opts)
+{
+    if (opts->chunk_size == 0 || opts->chunk_size % CAPI_CACHELINE_BYTES ||
+        !opts->max_inflight || opts->readers < 1 || opts->submitters < 1 ||
+        opts->harvesters < 1 || opts->writers < 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct pipeline *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->wq = wq;
+    p->in_fd = in_fd;
+    p->out_fd = out_fd;
+    p->opts = *opts;
+    p->in_seekable = is_seekable(in_fd);
+    p->out_seekable = out_fd < 0 || is_seekable(out_fd);
+
+    if (!p->out_seekable) {
+        p->opts.readers = p->opts.submitters = 1;
+        p->opts.harvesters = p->opts.writers = 1;
+    }
+
+    p->reader.name = "reader";
+    p->reader.threads = p->opts.readers;
+    p->submitter.name = "submitter";
+    p->submitter.threads = p->opts.submitters;
+    p->harvester.name = "harvester";
+    p->harvester.threads = p->opts.harvesters;
+    p->writer.name = "writer";
+    p->writer.threads = p->opts.writers;
+
+    if (pthread_mutex_init(&p->read_mutex, NULL))
+        goto free_p;
+
+    size_t entries = fifo_entries(p->opts.max_inflight);
+    p->free_bufs = fifo_mpmc_new(entries);
+    if (p->free_bufs == NULL)
+        goto destroy_mutex;
+    p->to_submit = stage_fifo(entries, p->opts.readers,
+                              p->opts.submitters);
+    if (p->to_submit == NULL)
+        goto free_free_bufs;
+    p->to_write = stage_fifo(entries, p->opts.harvesters,
+                             p->opts.writers);
+    if (p->to_write == NULL)
+        goto free_to_submit;
+
+    p->eos = capi_alloc(CAPI_CACHELINE_BYTES);
+    if (p->eos == NULL)
+        goto free_to_write;
+    memset(p->eos, 0, CAPI_CACHELINE_BYTES);
+
+    p->bufs = calloc(p->opts.max_inflight, sizeof(*p->bufs));
+    if (p->bufs == NULL)
+        goto free_eos;
+
+    if (capi_alloc_pages_node(&p->buf_mem,
+                              p->opts.max_inflight * p->opts.chunk_size,
+                              p->opts.backing, p->opts.node))
+        goto free_bufs;
+
+    for (size_t i = 0; i < p->opts.max_inflight; i++)
+        p->bufs[i].data = (char *) p->buf_mem.addr + i * p->opts.chunk_size;
+
+    return p;
+
+free_bufs:
+    free(p->bufs);
+free_eos:
+    free(p->eos);
+free_to_write:
+    fifo_free(p->to_write);
+free_to_submit:
+    fifo_free(p->to_submit);
+free_free_bufs:
+    fifo_free(p->free_bufs);
+destroy_mutex:
+    pthread_mutex_destroy(&p->read_mutex);
+free_p:
+    free(p);
+    return NULL;
+}
+
+void pipeline_free(struct pipeline *p)
+{
+    if (p->ran) {
+        worker_free(&p->reader.worker);
+        worker_free(&p->submitter.worker);
+        worker_free(&p->harvester.worker);
+        worker_free(&p->writer.worker);
+    }
+
+    capi_free_pages(&p->buf_mem);
+    free(p->bufs);
+    free(p->eos);
+
+    fifo_free(p->to_write);
+    fifo_free(p->to_submit);
+    fifo_free(p->free_bufs);
+    pthread_mutex_destroy(&p->read_mutex);
+    free(p);
+}
+
+static void stage_finish(struct pipeline *p, struct stage *s,
+                         uint64_t items, uint64_t bytes)
+{
+    if (p->opts.node >= 0 && topo_current_node() != p->opts.node)
+        __atomic_add_fetch(&s->remote, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&s->items, items, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+
+    uint64_t now = utils_monotonic_ns();
+    uint64_t cur = __atomic_load_n(&s->end_ns, __ATOMIC_RELAXED);
+    while (now > cur &&
+           !__atomic_compare_exchange_n(&s->end_ns, &cur, now, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    worker_finish_thread(&s->worker);
+}
+
+static void set_error(struct pipeline *p, const char *msg, int err)
+{
+    fprintf(stderr, "pipeline: %s: %s\n", msg, strerror(err));
+    __atomic_store_n(&p->errors, 1, __ATOMIC_RELAXED);
+}
+
+// Closing free_bufs wakes readers waiting for a buffer that may never
+// come back
+static void stop_readers(struct pipeline *p)
+{
+    if (!__atomic_exchange_n(&p->readers_stopped, 1, __ATOMIC_RELAXED))
+        fifo_close(p->free_bufs);
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len, off_t offset,
+                         int seekable)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n;
+        if (seekable)
+            n = pread(fd, (char *) buf + done, len - done, offset + done);
+        else
+            n = read(fd, (char *) buf + done, len - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+static ssize_t read_chunk(struct pipeline *p, struct pipeline_buf *b)
+{
+    ssize_t ret;
+
+    if (p->in_seekable) {
+        b->offset = __atomic_fetch_add(&p->read_offset, p->opts.chunk_size,
+                                       __ATOMIC_RELAXED);
+        ret = read_full(p->in_fd, b->data, p->opts.chunk_size, b->offset, 1);
+    } else {
+        pthread_mutex_lock(&p->read_mutex);
+        b->offset = p->read_offset;
+        ret = read_full(p->in_fd, b->data, p->opts.chunk_size, 0, 0);
+        if (ret > 0)
+            p->read_offset += ret;
+        pthread_mutex_unlock(&p->read_mutex);
+    }
+
+    if (ret > 0) {
+        b->len = ret;
+
+        // The AFU works in whole cache lines
+        size_t padded = (ret + CAPI_CACHELINE_BYTES - 1) &
+            ~(CAPI_CACHELINE_BYTES - 1);
+        memset((char *) b->data + ret, 0, padded - ret);
+    }
+
+    return ret;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct pipeline *p = container_of(w, struct pipeline, reader.worker);
+    trace_thread_name("reader");
+    uint64_t items = 0, bytes = 0;
+
+    while (!__atomic_load_n(&p->errors, __ATOMIC_RELAXED)) {
+        struct pipeline_buf *b = fifo_pop(p->free_bufs);
+        if (b == NULL)
+            break;
+
+        ssize_t n = read_chunk(p, b);
+        if (n <= 0) {
+            if (n < 0)
+                set_error(p, "reading input", errno);
+            fifo_push(p->free_bufs, b);
+            break;
+        }
+
+        items++;
+        bytes += n;
+        fifo_push(p->to_submit, b);
+    }
+
+    fifo_close(p->to_submit);
+    stage_finish(p, &p->reader, items, bytes);
+
+    return NULL;
+}
+
+// How long a submitter sleeps between attempts when the ring is full
+#define SUBMIT_RETRY_US 100
+
+// The ring only fills up when it is shorter than max_inflight and then
+// only a harvester can make room. Rather than block where a dead AFU
+// would leave us stuck, poll while the run hasn't failed. Returns -1 if
+// the item was dropped because it has.
+static int submit(struct pipeline *p, const struct wqueue_item *it)
+{
+    while (wqueue_try_push(p->wq, it)) {
+        if (__atomic_load_n(&p->errors, __ATOMIC_RELAXED))
+            return -1;
+        usleep(SUBMIT_RETRY_US);
+    }
+
+    return 0;
+}
+
+static void *submitter_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct pipeline *p = container_of(w, struct pipeline, submitter.worker);
+    trace_thread_name("submitter");
+    uint64_t items = 0, bytes = 0;
+    struct pipeline_buf *b;
+
+    while ((b = fifo_pop(p->to_submit)) != NULL) {
+        struct wqueue_item it = {
+            .src = b->data,
+            .dst = b->data,
+            .src_len = (b->len + CAPI_CACHELINE_BYTES - 1) &
+                       ~(CAPI_CACHELINE_BYTES - 1),
+            .opaque = b,
+        };
+
+        // After an error the rest of the input is only drained
+        if (__atomic_load_n(&p->errors, __ATOMIC_RELAXED) || submit(p, &it))
+            continue;
+
+        items++;
+        bytes += b->len;
+    }
+
+    // The last submitter out tells each harvester to stop. After an
+    // error the harvesters stop by themselves when the AFU times out.
+    if (__atomic_sub_fetch(&p->submitters_left, 1, __ATOMIC_ACQ_REL) == 0 &&
+        !__atomic_load_n(&p->errors, __ATOMIC_RELAXED))
+    {
+        struct wqueue_item it = {
+            .flags = WQ_LAST_ITEM_FLAG,
+            .src = p->eos,
+            .dst = p->eos,
+            .src_len = CAPI_CACHELINE_BYTES,
+        };
+
+        for (int i = 0; i < p->harvester.threads; i++)
+            if (submit(p, &it))
+                break;
+    }
+
+    stage_finish(p, &p->submitter, items, bytes);
+
+    return NULL;
+}
+
+// Completed chunks are handed on in batches of up to this many
+#define HARVEST_BATCH 64
+
+static void *harvester_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct pipeline *p = container_of(w, struct pipeline, harvester.worker);
+    trace_thread_name("harvester");
+    uint64_t items = 0, bytes = 0;
+    struct wqueue_item its[HARVEST_BATCH];
+    void *done[HARVEST_BATCH];
+    int markers = 0;
+
+    while (!markers) {
+        int n = wqueue_pop_batch(p->wq, its, HARVEST_BATCH);
+
+        if (n < 0 && p->opts.wait_forever) {
+            fprintf(stderr, "pipeline: timed out waiting for the AFU, "
+                    "still waiting\n");
+            continue;
+        }
+
+        // The chunks still in the AFU never come back, so stop taking
+        // input and let the other stages drain what they hold
+        if (n < 0) {
+            set_error(p, "waiting for the AFU", ETIMEDOUT);
+            stop_readers(p);
+            break;
+        }
+
+        size_t count = 0;
+        for (int i = 0; i < n; i++) {
+            if (its[i].flags & WQ_LAST_ITEM_FLAG) {
+                markers++;
+                continue;
+            }
+
+            if (its[i].error_code) {
+                fprintf(stderr, "pipeline: AFU returned error code 0x%04x\n",
+                        its[i].error_code);
+                __atomic_store_n(&p->errors, 1, __ATOMIC_RELAXED);
+            }
+
+            struct pipeline_buf *b = its[i].opaque;
+            items++;
+            bytes += b->len;
+            done[count++] = b;
+        }
+
+        fifo_push_n(p->to_write, done, count);
+    }
+
+    // Markers come after every chunk, but a batch may have caught the
+    // ones meant for the other harvesters
+    for (int i = 1; i < markers; i++) {
+        struct wqueue_item it = {
+            .flags = WQ_LAST_ITEM_FLAG,
+            .src = p->eos,
+            .dst = p->eos,
+            .src_len = CAPI_CACHELINE_BYTES,
+        };
+
+        wqueue_push(p->wq, &it);
+    }
+
+    fifo_close(p->to_write);
+    stage_finish(p, &p->harvester, items, bytes);
+
+    return NULL;
+}
+
+static int write_full(int fd, const void *buf, size_t len, off_t offset,
+                      int seekable)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n;
+        if (seekable)
+            n = pwrite(fd, (const char *) buf + done, len - done,
+                       offset + done);
+        else
+            n = write(fd, (const char *) buf + done, len - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+
+        done += n;
+    }
+
+    return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct pipeline *p = container_of(w, struct pipeline, writer.worker);
+    trace_thread_name("writer");
+    uint64_t items = 0, bytes = 0;
+    void *bufs[HARVEST_BATCH];
+    size_t n;
+
+    while ((n = fifo_pop_n(p->to_write, bufs, HARVEST_BATCH)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            struct pipeline_buf *b = bufs[i];
+
+            // Keep draining after an error so the other stages can finish
+            if (p->out_fd >= 0 &&
+                !__atomic_load_n(&p->errors, __ATOMIC_RELAXED))
+            {
+                if (write_full(p->out_fd, b->data, b->len, b->offset,
+                               p->out_seekable))
+                    set_error(p, "writing output", errno);
+            }
+
+            items++;
+            bytes += b->len;
+        }
+
+        fifo_push_n(p->free_bufs, bufs, n);
+    }
+
+    stage_finish(p, &p->writer, items, bytes);
+
+    return NULL;
+}
+
+static int start_stage(struct pipeline *p, struct stage *s,
+                       void *(*fn)(void *))
+{
+    int ret;
+
+    if (p->opts.node >= 0)
+        ret = worker_start_node(&s->worker, s->threads, fn, p->opts.node);
+    else
+        ret = worker_start(&s->worker, s->threads, fn);
+
+    if (ret) {
+        fprintf(stderr, "pipeline: unable to start %s threads\n", s->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stands in for the first stage that failed to start by ending its
+// output the way it would have, so the later stages that are already
+// running see the end of the stream and finish, then joins them
+static void abort_start(struct pipeline *p, int started)
+{
+    struct wqueue_item it = {
+        .flags = WQ_LAST_ITEM_FLAG,
+        .src = p->eos,
+        .dst = p->eos,
+        .src_len = CAPI_CACHELINE_BYTES,
+    };
+
+    switch (started) {
+    case 1:
+        for (int i = 0; i < p->harvester.threads; i++)
+            fifo_close(p->to_write);
+        break;
+    case 2:
+        for (int i = 0; i < p->harvester.threads; i++)
+            wqueue_push(p->wq, &it);
+        break;
+    case 3:
+        for (int i = 0; i < p->reader.threads; i++)
+            fifo_close(p->to_submit);
+        break;
+    }
+
+    struct stage *stages[] = {&p->writer, &p->harvester, &p->submitter};
+    for (int i = 0; i < started; i++) {
+        worker_join(&stages[i]->worker);
+        worker_free(&stages[i]->worker);
+    }
+
+    stop_readers(p);
+}
+
+int pipeline_run(struct pipeline *p)
+{
+    // free_bufs stays open for the whole run so readers block on it
+    // rather than seeing it as finished whenever it runs dry
+    fifo_open(p->free_bufs);
+    for (size_t i = 0; i < p->opts.max_inflight; i++)
+        fifo_push(p->free_bufs, &p->bufs[i]);
+
+    for (int i = 0; i < p->reader.threads; i++)
+        fifo_open(p->to_submit);
+    for (int i = 0; i < p->harvester.threads; i++)
+        fifo_open(p->to_write);
+
+    p->submitters_left = p->submitter.threads;
+    p->start_ns = utils_monotonic_ns();
+
+    // Later stages are started first so they are ready to drain the
+    // earlier ones
+    struct stage *stages[] = {&p->writer, &p->harvester, &p->submitter,
+                              &p->reader};
+    void *(*fns[])(void *) = {writer_thread, harvester_thread,
+                              submitter_thread, reader_thread};
+
+    int started;
+    for (started = 0; started < 4; started++)
+        if (start_stage(p, stages[started], fns[started]))
+            break;
+
+    if (started < 4) {
+        int err = errno;
+        abort_start(p, started);
+        errno = err;
+        return -1;
+    }
+
+    worker_join(&p->reader.worker);
+    worker_join(&p->submitter.worker);
+    worker_join(&p->harvester.worker);
+    worker_join(&p->writer.worker);
+    stop_readers(p);
+    p->ran = 1;
+
+    return p->errors ? -1 : 0;
+}
+
+static void print_stage(struct stage *s, FILE *out, uint64_t start_ns)
+{
+    double secs = (s->end_ns - start_ns) / 1e9;
+
+    fprintf(out, "%-10s  %2d threads  %10llu chunks  %12llu bytes  "
+            "%9.1f MB/s\n", s->name, s->threads,
+            (unsigned long long) s->items, (unsigned long long) s->bytes,
+            secs > 0 ? s->bytes / secs / 1e6 : 0);
+}
+
+// Report how much of the work happened away from the chosen node: the
+// buffer pages resident elsewhere and the threads that finished on a
+// CPU of another node
+static void print_placement(struct pipeline *p, FILE *out,
+                            struct stage **stages)
+{
+    long counts[64];
+    int nodes = topo_num_nodes();
+    if (nodes > 64)
+        nodes = 64;
+
+    long pages = topo_page_nodes(p->buf_mem.addr, p->buf_mem.len, counts,
+                                 nodes);
+    if (pages > 0) {
+        long remote = 0;
+        for (int i = 0; i < nodes; i++)
+            if (i != p->opts.node)
+                remote += counts[i];
+
+        fprintf(out, "Buffer pages off node %d: %ld of %ld\n",
+                p->opts.node, remote, pages);
+    }
+
+    for (int i = 0; i < 4; i++)
+        fprintf(out, "%s threads off node %d: %d of %d\n",
+                stages[i]->name, p->opts.node, stages[i]->remote,
+                stages[i]->threads);
+
+    fprintf(out, "\n");
+}
+
+void pipeline_print_stats(struct pipeline *p, FILE *out)
+{
+    struct stage *stages[] = {&p->reader, &p->submitter, &p->harvester,
+                              &p->writer};
+
+    fprintf(out, "Buffers: %zu x %zu bytes on %s\n\n", p->opts.max_inflight,
+            p->opts.chunk_size, capi_backing_name(p->buf_mem.backing));
+
+    for (int i = 0; i < 4; i++)
+        print_stage(stages[i], out, p->start_ns);
+
+    fprintf(out, "\n");
+
+    // A fifo that sits full points at a slow stage after it and one
+    // that sits empty at a slow stage before it
+    struct fifo *fifos[] = {p->free_bufs, p->to_submit, p->to_write};
+    const char *fifo_names[] = {"free_bufs", "to_submit", "to_write"};
+
+    for (int i = 0; i < 3; i++) {
+        struct fifo_stats fs;
+        fifo_stats(fifos[i], &fs);
+        fifo_print_stats(&fs, fifo_names[i], out);
+    }
+    fprintf(out, "\n");
+
+    struct fifo_batch_stats bs;
+    fifo_batch_stats(p->to_write, &bs);
+    if (bs.push_calls && bs.pop_calls)
+        fprintf(out, "Harvested chunks moved %.1f per push, %.1f per pop "
+                "(max %d, %d)\n\n", (double) bs.push_items / bs.push_calls,
+                (double) bs.pop_items / bs.pop_calls, bs.max_push,
+                bs.max_pop);
+
+    if (p->opts.node >= 0)
+        print_placement(p, out, stages);
+
+    for (int i = 0; i < 4; i++) {
+        fprintf(out, "%s CPU time:\n", stages[i]->name);
+        worker_fprint_cputime(&stages[i]->worker, NULL, "", out);
+    }
+}
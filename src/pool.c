@@ -0,0 +1,510 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Recycling buffer pool for cache-line-aligned CAPI buffers
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "pool.h"
+#include "capi.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+
+#define POOL_MAX_CLASSES    32
+
+// Buffers of one class a thread keeps before spilling POOL_BATCH of
+// them back to the shared list, and how many it takes when it runs out
+#define POOL_CACHE_MAX      32
+#define POOL_BATCH          16
+
+// Each buffer is preceded by a header a whole cache line long so the
+// buffer itself stays cache-line aligned
+#define POOL_HDR_BYTES      CAPI_CACHELINE_BYTES
+
+// Hugepage backed pools carve buffers out of slabs at least this big
+#define POOL_SLAB_BYTES     (2UL << 20)
+
+struct pool_hdr {
+    struct pool *pool;
+    struct pool_hdr *next;
+    int cls;
+};
+
+struct pool_list {
+    struct pool_hdr *head;
+    size_t count;
+};
+
+struct pool_slab {
+    struct capi_mem mem;
+    struct pool_slab *next;
+};
+
+struct pool_cache {
+    struct pool *pool;
+    struct pool_cache *next, *prev;
+    struct pool_list cls[POOL_MAX_CLASSES];
+};
+
+struct pool {
+    int classes;
+    size_t max_bytes;
+    size_t bytes;
+
+    enum capi_backing backing;
+    enum capi_backing obtained;
+    int node;
+    struct pool_slab *slabs;
+
+    pthread_key_t key;
+    pthread_mutex_t caches_mutex;
+    struct pool_cache *caches;
+
+    pthread_mutex_t mutex[POOL_MAX_CLASSES];
+    struct pool_list cls[POOL_MAX_CLASSES];
+};
+
+static inline struct pool_hdr *to_hdr(const void *buf)
+{
+    return (struct pool_hdr *) ((char *) buf - POOL_HDR_BYTES);
+}
+
+static inline void *to_buf(struct pool_hdr *h)
+{
+    return (char *) h + POOL_HDR_BYTES;
+}
+
+static inline size_t class_size(int cls)
+{
+    return (size_t) CAPI_CACHELINE_BYTES << cls;
+}
+
+static int class_of(size_t size)
+{
+    int cls = 0;
+
+    while (class_size(cls) < size)
+        cls++;
+
+    return cls;
+}
+
+static inline void list_push(struct pool_list *l, struct pool_hdr *h)
+{
+    h->next = l->head;
+    l->head = h;
+    l->count++;
+}
+
+static inline struct pool_hdr *list_pop(struct pool_list *l)
+{
+    struct pool_hdr *h = l->head;
+
+    if (h != NULL) {
+        l->head = h->next;
+        l->count--;
+    }
+
+    return h;
+}
+
+static void list_free(struct pool_list *l)
+{
+    struct pool_hdr *h;
+
+    while ((h = list_pop(l)) != NULL)
+        free(h);
+}
+
+// Move up to n buffers from one list to another
+static void list_move(struct pool_list *to, struct pool_list *from, size_t n)
+{
+    struct pool_hdr *h;
+
+    while (n-- && (h = list_pop(from)) != NULL)
+        list_push(to, h);
+}
+
+static void cache_flush(struct pool *p, struct pool_cache *c)
+{
+    for (int i = 0; i < p->classes; i++) {
+        if (!c->cls[i].count)
+            continue;
+
+        pthread_mutex_lock(&p->mutex[i]);
+        list_move(&p->cls[i], &c->cls[i], c->cls[i].count);
+        pthread_mutex_unlock(&p->mutex[i]);
+    }
+}
+
+static void cache_destroy(void *arg)
+{
+    struct pool_cache *c = arg;
+    struct pool *p = c->pool;
+
+    pthread_mutex_lock(&p->caches_mutex);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        p->caches = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    pthread_mutex_unlock(&p->caches_mutex);
+
+    cache_flush(p, c);
+    free(c);
+}
+
+static inline int use_slabs(struct pool *p)
+{
+    return p->backing != CAPI_BACKING_NORMAL || p->node >= 0;
+}
+
+static struct pool_cache *get_cache(struct pool *p)
+{
+    struct pool_cache *c = pthread_getspecific(p->key);
+    if (c != NULL)
+        return c;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    c->pool = p;
+
+    if (pthread_setspecific(p->key, c)) {
+        free(c);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&p->caches_mutex);
+    c->next = p->caches;
+    if (c->next)
+        c->next->prev = c;
+    p->caches = c;
+    pthread_mutex_unlock(&p->caches_mutex);
+
+    return c;
+}
+
+struct pool *pool_new(size_t max_buf_size, size_t max_bytes)
+{
+    return pool_new_backed(max_buf_size, max_bytes, CAPI_BACKING_NORMAL);
+}
+
+struct pool *pool_new_backed(size_t max_buf_size, size_t max_bytes,
+                             enum capi_backing backing)
+{
+    if (max_buf_size == 0 ||
+        max_buf_size > class_size(POOL_MAX_CLASSES - 1))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct pool *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->classes = class_of(max_buf_size) + 1;
+    p->max_bytes = max_bytes;
+    p->backing = p->obtained = backing;
+    p->node = -1;
+
+    int err = pthread_key_create(&p->key, cache_destroy);
+    if (err)
+        goto free_p;
+
+    if ((err = pthread_mutex_init(&p->caches_mutex, NULL)))
+        goto delete_key;
+
+    int i;
+    for (i = 0; i < p->classes; i++)
+        if ((err = pthread_mutex_init(&p->mutex[i], NULL)))
+            goto destroy_mutexes;
+
+    return p;
+
+destroy_mutexes:
+    while (i--)
+        pthread_mutex_destroy(&p->mutex[i]);
+    pthread_mutex_destroy(&p->caches_mutex);
+delete_key:
+    pthread_key_delete(p->key);
+free_p:
+    free(p);
+    errno = err;
+    return NULL;
+}
+
+int pool_set_node(struct pool *p, int node)
+{
+    if (pool_bytes(p)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    p->node = node;
+    return 0;
+}
+
+void pool_free(struct pool *p)
+{
+    // Deleting the key first means no thread destructor can run
+    // against the caches while they are torn down here
+    pthread_key_delete(p->key);
+
+    // Buffers carved from slabs go away with their slab
+    int own_bufs = !use_slabs(p);
+
+    struct pool_cache *c = p->caches;
+    while (c != NULL) {
+        struct pool_cache *next = c->next;
+
+        for (int i = 0; i < p->classes && own_bufs; i++)
+            list_free(&c->cls[i]);
+        free(c);
+
+        c = next;
+    }
+
+    for (int i = 0; i < p->classes; i++) {
+        if (own_bufs)
+            list_free(&p->cls[i]);
+        pthread_mutex_destroy(&p->mutex[i]);
+    }
+
+    while (p->slabs != NULL) {
+        struct pool_slab *next = p->slabs->next;
+        capi_free_pages(&p->slabs->mem);
+        free(p->slabs);
+        p->slabs = next;
+    }
+
+    pthread_mutex_destroy(&p->caches_mutex);
+    free(p);
+}
+
+// Reserve room for up to n buffers of the given size under the byte
+// cap, returning how many fit
+static size_t reserve(struct pool *p, size_t size, size_t n)
+{
+    size_t cur = __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+    size_t got;
+
+    do {
+        got = n;
+        if (p->max_bytes && cur + got * size > p->max_bytes)
+            got = cur < p->max_bytes ? (p->max_bytes - cur) / size : 0;
+        if (!got)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&p->bytes, &cur, cur + got * size,
+                                          1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return got;
+}
+
+// Map a new slab, hand back its first buffer and put the rest on the
+// class's shared list
+static struct pool_hdr *new_slab(struct pool *p, int cls)
+{
+    size_t size = class_size(cls);
+    size_t stride = POOL_HDR_BYTES + size;
+
+    struct pool_slab *slab = malloc(sizeof(*slab));
+    if (slab == NULL)
+        return NULL;
+
+    size_t len = stride > POOL_SLAB_BYTES ? stride : POOL_SLAB_BYTES;
+    enum capi_backing backing = p->backing;
+    if (backing >= CAPI_BACKING_HUGE_1G && len < CAPI_HUGE_1G_MIN_BYTES)
+        backing = CAPI_BACKING_HUGE_2M;
+
+    if (capi_alloc_pages_node(&slab->mem, len, backing, p->node))
+        goto free_slab;
+
+    size_t n = reserve(p, size, slab->mem.len / stride);
+    if (!n) {
+        errno = ENOMEM;
+        goto free_pages;
+    }
+
+    pthread_mutex_lock(&p->caches_mutex);
+    slab->next = p->slabs;
+    p->slabs = slab;
+    if (slab->mem.backing < p->obtained)
+        p->obtained = slab->mem.backing;
+    pthread_mutex_unlock(&p->caches_mutex);
+
+    struct pool_list l = {};
+    for (size_t i = 0; i < n; i++) {
+        struct pool_hdr *h = (void *) ((char *) slab->mem.addr + i * stride);
+        h->pool = p;
+        h->cls = cls;
+        list_push(&l, h);
+    }
+
+    struct pool_hdr *ret = list_pop(&l);
+
+    pthread_mutex_lock(&p->mutex[cls]);
+    list_move(&p->cls[cls], &l, l.count);
+    pthread_mutex_unlock(&p->mutex[cls]);
+
+    return ret;
+
+free_pages:
+    capi_free_pages(&slab->mem);
+free_slab:
+    free(slab);
+    return NULL;
+}
+
+static struct pool_hdr *new_buf(struct pool *p, int cls)
+{
+    void *mem;
+    size_t size = class_size(cls);
+
+    if (use_slabs(p))
+        return new_slab(p, cls);
+
+    if (!reserve(p, size, 1)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mem = capi_alloc(POOL_HDR_BYTES + size);
+    if (mem == NULL) {
+        __atomic_sub_fetch(&p->bytes, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    struct pool_hdr *h = mem;
+    h->pool = p;
+    h->cls = cls;
+
+    return h;
+}
+
+void *pool_get(struct pool *p, size_t size)
+{
+    if (size == 0 || size > class_size(p->classes - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int cls = class_of(size);
+    struct pool_cache *c = get_cache(p);
+    if (c == NULL)
+        return NULL;
+
+    struct pool_list *l = &c->cls[cls];
+    if (l->head == NULL) {
+        pthread_mutex_lock(&p->mutex[cls]);
+        list_move(l, &p->cls[cls], POOL_BATCH);
+        pthread_mutex_unlock(&p->mutex[cls]);
+    }
+
+    struct pool_hdr *h = list_pop(l);
+    if (h == NULL)
+        h = new_buf(p, cls);
+
+    return h ? to_buf(h) : NULL;
+}
+
+void pool_put(void *buf)
+{
+    if (buf == NULL)
+        return;
+
+    struct pool_hdr *h = to_hdr(buf);
+    struct pool *p = h->pool;
+    int cls = h->cls;
+    struct pool_cache *c = get_cache(p);
+
+    if (c == NULL) {
+        pthread_mutex_lock(&p->mutex[cls]);
+        list_push(&p->cls[cls], h);
+        pthread_mutex_unlock(&p->mutex[cls]);
+        return;
+    }
+
+    struct pool_list *l = &c->cls[cls];
+    list_push(l, h);
+
+    if (l->count > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&p->mutex[cls]);
+        list_move(&p->cls[cls], l, POOL_BATCH);
+        pthread_mutex_unlock(&p->mutex[cls]);
+    }
+}
+
+int pool_prefill(struct pool *p, size_t size, size_t count)
+{
+    if (size == 0 || size > class_size(p->classes - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int cls = class_of(size);
+    struct pool_list l = {};
+
+    for (size_t i = 0; i < count; i++) {
+        pthread_mutex_lock(&p->mutex[cls]);
+        struct pool_hdr *h = list_pop(&p->cls[cls]);
+        pthread_mutex_unlock(&p->mutex[cls]);
+
+        if (h == NULL && (h = new_buf(p, cls)) == NULL)
+            break;
+
+        // Touch every page now rather than on the data path
+        memset(to_buf(h), 0, class_size(cls));
+        list_push(&l, h);
+    }
+
+    int ret = l.count == count ? 0 : -1;
+
+    pthread_mutex_lock(&p->mutex[cls]);
+    list_move(&p->cls[cls], &l, l.count);
+    pthread_mutex_unlock(&p->mutex[cls]);
+
+    return ret;
+}
+
+size_t pool_buf_size(const void *buf)
+{
+    return class_size(to_hdr(buf)->cls);
+}
+
+enum capi_backing pool_backing(struct pool *p)
+{
+    pthread_mutex_lock(&p->caches_mutex);
+    enum capi_backing ret = p->obtained;
+    pthread_mutex_unlock(&p->caches_mutex);
+
+    return ret;
+}
+
+size_t pool_bytes(struct pool *p)
+{
+    return __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+}
@@ -156,45 +156,72 @@ uint64_t snooper_tag_alert(struct cxl_afu_h *afu)
     return ret;
 }
 
-void snooper_tag_usage(struct cxl_afu_h *afu)
+int snooper_read_tag_usage(struct cxl_afu_h *afu,
+                           struct snooper_tag_usage *usage)
 {
-    uint32_t tag_count, acc_count;
-    cxl->mmio_read32(afu, &mmio->tag_count, &tag_count);
-    cxl->mmio_read32(afu, &mmio->acc_count, &acc_count);
+    if (mmio == NULL)
+        return -1;
+
+    cxl->mmio_read32(afu, &mmio->tag_count, &usage->tag_count);
+    cxl->mmio_read32(afu, &mmio->acc_count, &usage->acc_count);
 
-    printf("Tag Usage:          %.3e\n", (double)tag_count/
-        acc_count);
+    return 0;
 }
 
-void snooper_tag_stats(struct cxl_afu_h *afu, int dump)
+void snooper_tag_usage(struct cxl_afu_h *afu)
 {
-    uint32_t tag_min, tag_max, count = 0;
-    uint64_t tag_avg = 0, tag_std = 0;
-    cxl->mmio_read32(afu, &mmio->tag_min, &tag_min);
-    cxl->mmio_read32(afu, &mmio->tag_max, &tag_max);
+    struct snooper_tag_usage usage;
 
-    if (mmio == NULL)
+    if (snooper_read_tag_usage(afu, &usage))
         return;
 
+    printf("Tag Usage:          %.3e\n", (double)usage.tag_count/
+        usage.acc_count);
+}
+
+int snooper_read_tag_stats(struct cxl_afu_h *afu,
+                           struct snooper_tag_stats *stats, int dump)
+{
+    if (mmio == NULL)
+        return -1;
+
+    cxl->mmio_read32(afu, &mmio->tag_min, &stats->min);
+    cxl->mmio_read32(afu, &mmio->tag_max, &stats->max);
+    stats->count = 0;
+    stats->sum = stats->sum_sq = 0;
+
     while(1) {
         uint64_t tag_data;
         cxl->mmio_read64(afu, &mmio->tag_data, (uint64_t *)&tag_data);
         if (!tag_data)
             break;
 
-	if (dump)
-	  fprintf(stderr, "TAG: %-4d\t%8d\n", count,
-		  (uint32_t)tag_data);
+        if (dump)
+            fprintf(stderr, "TAG: %-4d\t%8d\n", stats->count,
+                    (uint32_t)tag_data);
 
-        tag_avg += tag_data;
-        tag_std += (tag_data*tag_data);
-        count++;
+        stats->sum += tag_data;
+        stats->sum_sq += (tag_data*tag_data);
+        stats->count++;
     }
-    if (!count)
-        printf("Tag Time (min/max): %d/%d\n", tag_min,
-               tag_max);
+
+    return 0;
+}
+
+void snooper_tag_stats(struct cxl_afu_h *afu, int dump)
+{
+    struct snooper_tag_stats stats;
+
+    if (snooper_read_tag_stats(afu, &stats, dump))
+        return;
+
+    if (!stats.count)
+        printf("Tag Time (min/max): %d/%d\n", stats.min,
+               stats.max);
     else{
-        printf("Tag Time (avg/std/min/max/count): %2.2f/%2.2f/%d/%d/%d\n", (double)tag_avg/count,
-               (double)tag_std/count, tag_min, tag_max, count);
+        printf("Tag Time (avg/std/min/max/count): %2.2f/%2.2f/%d/%d/%d\n",
+               (double)stats.sum/stats.count,
+               (double)stats.sum_sq/stats.count, stats.min, stats.max,
+               stats.count);
     }
 }
@@ -0,0 +1,207 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     NUMA topology helpers
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "topo.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define MPOL_PREFERRED      1
+#define MPOL_BIND           2
+
+#define MAX_NODES           64
+#define QUERY_BATCH         1024
+
+// Parse a sysfs list such as "0-3,8-11" into a cpu set, returning the
+// highest number seen or -1 on a parse error
+static int parse_list(const char *s, cpu_set_t *set)
+{
+    int max = -1;
+
+    if (set)
+        CPU_ZERO(set);
+
+    while (*s && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s)
+            return -1;
+
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s)
+                return -1;
+        }
+
+        for (long i = lo; i <= hi; i++)
+            if (set && i < CPU_SETSIZE)
+                CPU_SET(i, set);
+
+        if (hi > max)
+            max = hi;
+
+        s = *end == ',' ? end + 1 : end;
+    }
+
+    return max;
+}
+
+static int read_line(const char *path, char *buf, size_t len)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char *ret = fgets(buf, len, f);
+    fclose(f);
+
+    return ret ? 0 : -1;
+}
+
+int topo_num_nodes(void)
+{
+    char buf[256];
+
+    if (read_line("/sys/devices/system/node/possible", buf, sizeof(buf)))
+        return 1;
+
+    int max = parse_list(buf, NULL);
+    return max < 0 ? 1 : max + 1;
+}
+
+int topo_node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[PATH_MAX];
+    char buf[4096];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+
+    if (read_line(path, buf, sizeof(buf)))
+        return -1;
+
+    if (parse_list(buf, cpus) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int topo_current_node(void)
+{
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL))
+        return -1;
+
+    return node;
+}
+
+int topo_afu_node(const char *cxl_dev)
+{
+    static const char *const fmts[] = {
+        "/sys/class/cxl/%s/device/device/numa_node",
+        "/sys/class/cxl/%s/device/numa_node",
+    };
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    char buf[32];
+
+    const char *base = strrchr(cxl_dev, '/');
+    snprintf(name, sizeof(name), "%s", base ? base + 1 : cxl_dev);
+
+    // /dev/cxl/afu0.0d is afu0.0 in sysfs: drop the mode suffix
+    size_t len = strlen(name);
+    while (len && !isdigit((unsigned char) name[len - 1]))
+        name[--len] = 0;
+
+    for (int i = 0; i < sizeof(fmts) / sizeof(*fmts); i++) {
+        snprintf(path, sizeof(path), fmts[i], name);
+        if (read_line(path, buf, sizeof(buf)) == 0)
+            return atoi(buf);
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+int topo_bind(void *addr, size_t len, int node, int strict)
+{
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (node < 0 || node >= MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mask[node / (8 * sizeof(*mask))] |= 1UL << (node % (8 * sizeof(*mask)));
+
+    unsigned long start = (unsigned long) addr & ~(page - 1);
+    len += (unsigned long) addr - start;
+
+    return syscall(SYS_mbind, start, len,
+                   strict ? MPOL_BIND : MPOL_PREFERRED, mask,
+                   MAX_NODES + 1, 0);
+}
+
+long topo_page_nodes(const void *addr, size_t len, long *counts,
+                     int max_nodes)
+{
+    void *pages[QUERY_BATCH];
+    int status[QUERY_BATCH];
+    long page = sysconf(_SC_PAGESIZE);
+    long total = 0;
+
+    memset(counts, 0, max_nodes * sizeof(*counts));
+
+    unsigned long start = (unsigned long) addr & ~(page - 1);
+    unsigned long end = (unsigned long) addr + len;
+
+    while (start < end) {
+        unsigned long n = 0;
+
+        for (; n < QUERY_BATCH && start < end; n++, start += page)
+            pages[n] = (void *) start;
+
+        if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0))
+            return -1;
+
+        // Pages not faulted in yet report a negative errno
+        for (unsigned long i = 0; i < n; i++)
+            if (status[i] >= 0 && status[i] < max_nodes)
+                counts[status[i]]++;
+
+        total += n;
+    }
+
+    return total;
+}
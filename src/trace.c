@@ -0,0 +1,241 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Low overhead event tracer with Chrome trace export
+//
+//     A thread's ring is allocated on its first event and pushed onto
+//     a global list with a CAS. Only the owning thread writes a ring;
+//     it fills the slot and then publishes the new head with a release
+//     store. A ring outlives its thread so a trace can still be dumped
+//     after its threads are gone; trace_clear() frees the rings of
+//     exited threads. Dumping while threads are still recording may
+//     show a few torn events at the oldest end of a wrapped ring.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+struct trace_event {
+    uint64_t ts_ns;
+    uint64_t dur_ns;
+    uint64_t arg;
+    const char *name;
+    char phase;
+    char track;
+};
+
+struct trace_ring {
+    struct trace_ring *next;
+    uint64_t head;
+    uint64_t mask;
+    int tid;
+    int exited;
+    char name[32];
+    struct trace_event events[];
+};
+
+int trace_on;
+
+// The list is only changed when a thread first traces and by
+// trace_clear() so a mutex is cheap enough
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static size_t ring_size = TRACE_RING_SIZE;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static __thread struct trace_ring *my_ring;
+static __thread char my_name[32];
+
+void trace_enable(int enable)
+{
+    __atomic_store_n(&trace_on, enable, __ATOMIC_RELAXED);
+}
+
+void trace_set_ring_size(size_t events)
+{
+    size_t size = 1;
+
+    while (size < events)
+        size <<= 1;
+
+    pthread_mutex_lock(&rings_mutex);
+    ring_size = size;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+// Runs as a tracing thread exits so trace_clear() knows its ring has no
+// writer left
+static void thread_exited(void *arg)
+{
+    struct trace_ring *r = arg;
+
+    __atomic_store_n(&r->exited, 1, __ATOMIC_RELEASE);
+    my_ring = NULL;
+}
+
+static void create_exit_key(void)
+{
+    pthread_key_create(&exit_key, thread_exited);
+}
+
+static struct trace_ring *get_ring(void)
+{
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_once(&exit_key_once, create_exit_key);
+
+    pthread_mutex_lock(&rings_mutex);
+    size_t size = ring_size;
+    struct trace_ring *r = calloc(1, sizeof(*r) + size * sizeof(r->events[0]));
+    if (r == NULL) {
+        pthread_mutex_unlock(&rings_mutex);
+        return NULL;
+    }
+
+    r->mask = size - 1;
+    r->tid = syscall(SYS_gettid);
+    memcpy(r->name, my_name, sizeof(r->name));
+
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_mutex);
+
+    pthread_setspecific(exit_key, r);
+
+    return my_ring = r;
+}
+
+void trace_clear(void)
+{
+    pthread_mutex_lock(&rings_mutex);
+
+    struct trace_ring **pr = &rings;
+    while (*pr != NULL) {
+        struct trace_ring *r = *pr;
+
+        if (__atomic_load_n(&r->exited, __ATOMIC_ACQUIRE)) {
+            *pr = r->next;
+            free(r);
+            continue;
+        }
+
+        __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+        pr = &r->next;
+    }
+
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+// Only remembered until the thread's ring exists so naming threads
+// costs nothing while tracing is off
+void trace_thread_name(const char *name)
+{
+    snprintf(my_name, sizeof(my_name), "%s", name);
+
+    if (my_ring != NULL)
+        memcpy(my_ring->name, my_name, sizeof(my_ring->name));
+}
+
+void trace_record(char phase, enum trace_track track, const char *name,
+                  uint64_t ts_ns, uint64_t dur_ns, uint64_t arg)
+{
+    struct trace_ring *r = get_ring();
+    if (r == NULL)
+        return;
+
+    uint64_t head = r->head;
+    struct trace_event *e = &r->events[head & r->mask];
+
+    e->ts_ns = ts_ns;
+    e->dur_ns = dur_ns;
+    e->arg = arg;
+    e->name = name;
+    e->phase = phase;
+    e->track = track;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// The AFU's timeline is given a tid no real thread can have
+#define AFU_TID     0
+
+static void dump_event(FILE *out, const struct trace_event *e, int tid,
+                       int *first)
+{
+    int pid = getpid();
+
+    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,"
+            "\"tid\":%d,\"ts\":%.3f", *first ? "" : ",", e->name,
+            e->phase, pid, e->track == TRACE_TRACK_AFU ? AFU_TID : tid,
+            e->ts_ns / 1e3);
+
+    if (e->phase == 'X')
+        fprintf(out, ",\"dur\":%.3f", e->dur_ns / 1e3);
+    else if (e->phase == 'i')
+        fprintf(out, ",\"s\":\"t\"");
+
+    fprintf(out, ",\"args\":{\"arg\":%" PRIu64 "}}", e->arg);
+    *first = 0;
+}
+
+static void dump_name(FILE *out, int tid, const char *name, int *first)
+{
+    fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",",
+            getpid(), tid, name);
+    *first = 0;
+}
+
+int trace_dump(FILE *out)
+{
+    struct trace_ring *r;
+    int first = 1;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    dump_name(out, AFU_TID, "AFU", &first);
+
+    pthread_mutex_lock(&rings_mutex);
+
+    for (r = rings; r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t start = head > r->mask ? head - r->mask - 1 : 0;
+
+        if (r->name[0])
+            dump_name(out, r->tid, r->name, &first);
+
+        for (uint64_t i = start; i < head; i++)
+            dump_event(out, &r->events[i & r->mask], r->tid, &first);
+    }
+
+    pthread_mutex_unlock(&rings_mutex);
+
+    fprintf(out, "\n]}\n");
+
+    return ferror(out) ? -1 : 0;
+}
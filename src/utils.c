@@ -28,8 +28,25 @@
 
 #include "utils.h"
 
+#include <time.h>
+
 double utils_timeval_to_secs(struct timeval *t)
 {
     return  t->tv_sec + t->tv_usec / 1e6;
 }
 
+uint64_t utils_monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t utils_monotonic_coarse_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -27,6 +27,7 @@
 #define WED_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 enum {
     WQ_READY_FLAG        = (1 << 0),
@@ -44,7 +45,26 @@ struct wed {
     uint64_t reserved[4];
     void *opaque;
     uint64_t src_len;
-    uint64_t unused[6];
+    uint32_t chain_left;
+    uint32_t src_crc;
+    void *group;
+    uint64_t push_ns;
+    uint64_t unused[3];
 };
 
+// The layout is fixed by the AFU, which reads the descriptor fields and
+// writes back flags, error_code, chunk_length and the timestamps. The
+// software fields after them must not grow the entry past 128 bytes.
+_Static_assert(sizeof(struct wed) == 128, "WED must be 128 bytes");
+_Static_assert(offsetof(struct wed, flags) == 0, "WED flags moved");
+_Static_assert(offsetof(struct wed, error_code) == 2,
+               "WED error_code moved");
+_Static_assert(offsetof(struct wed, chunk_length) == 4,
+               "WED chunk_length moved");
+_Static_assert(offsetof(struct wed, start_time) == 8,
+               "WED start_time moved");
+_Static_assert(offsetof(struct wed, end_time) == 12, "WED end_time moved");
+_Static_assert(offsetof(struct wed, src) == 16, "WED src moved");
+_Static_assert(offsetof(struct wed, dst) == 24, "WED dst moved");
+
 #endif
@@ -28,17 +28,39 @@
 
 #include "worker.h"
 #include "utils.h"
+#include "topo.h"
+#include "trace.h"
 
 #include <sys/time.h>
 #include <sys/resource.h>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 
-int worker_start(struct worker *w, int num_threads,
-                 void *(*start_routine) (void *))
+static void *thread_main(void *arg)
+{
+    struct worker *w = arg;
+
+    while (sem_wait(&w->gate) && errno == EINTR);
+    if (w->aborted)
+        return NULL;
+
+    uint64_t trace_start = trace_begin();
+
+    void *ret = w->start_routine(w);
+
+    trace_span("worker", trace_start, 0);
+
+    return ret;
+}
+
+static int start_threads(struct worker *w, int num_threads,
+                         void *(*start_routine) (void *),
+                         const pthread_attr_t *attr)
 {
     w->num_threads = num_threads;
+    w->start_routine = start_routine;
 
     w->threads = malloc(sizeof(*w->threads) * num_threads);
     if (w->threads == NULL)
@@ -48,27 +70,84 @@ int worker_start(struct worker *w, int num_threads,
     if (w->rusage == NULL)
         goto free_threads_and_exit;
 
-    int threads;
-    for (threads = 0; threads < num_threads; threads++)
-        if (pthread_create(&w->threads[threads], NULL, start_routine, w) != 0)
-            goto cancel_threads;
+    if (sem_init(&w->gate, 0, 0))
+        goto free_rusage;
+    w->aborted = 0;
 
-    return 0;
+    int threads, err = 0;
+    for (threads = 0; threads < num_threads; threads++) {
+        err = pthread_create(&w->threads[threads], attr, thread_main, w);
+        if (err)
+            break;
+    }
+
+    // The threads only start work once they are all there, so one that
+    // fails to start can be backed out of by letting the others return
+    // without running anything
+    w->aborted = err != 0;
+    for (int i = 0; i < threads; i++)
+        sem_post(&w->gate);
 
-cancel_threads:
-    threads--;
-    for (; threads >= 0; threads--)
-        pthread_cancel(w->threads[threads]);
+    if (!err)
+        return 0;
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(w->threads[i], NULL);
 
+    sem_destroy(&w->gate);
+    errno = err;
+
+free_rusage:
     free(w->rusage);
+    w->rusage = NULL;
 
 free_threads_and_exit:
     free(w->threads);
+    w->threads = NULL;
+    w->num_threads = 0;
 
     return 1;
 }
 
+int worker_start(struct worker *w, int num_threads,
+                 void *(*start_routine) (void *))
+{
+    return start_threads(w, num_threads, start_routine, NULL);
+}
+
+int worker_start_cpus(struct worker *w, int num_threads,
+                      void *(*start_routine) (void *), const cpu_set_t *cpus)
+{
+    pthread_attr_t attr;
+
+    if (pthread_attr_init(&attr))
+        return 1;
+
+    int ret = pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus) ||
+        start_threads(w, num_threads, start_routine, &attr);
+
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+int worker_start_node(struct worker *w, int num_threads,
+                      void *(*start_routine) (void *), int node)
+{
+    cpu_set_t cpus;
+
+    if (topo_node_cpus(node, &cpus))
+        return 1;
+
+    return worker_start_cpus(w, num_threads, start_routine, &cpus);
+}
+
 void worker_print_cputime(struct worker *w, struct rusage *ru, const char *x)
+{
+    worker_fprint_cputime(w, ru, x, stderr);
+}
+
+void worker_fprint_cputime(struct worker *w, struct rusage *ru, const char *x,
+                           FILE *out)
 {
     double user_total = 0;
     double sys_total = 0;
@@ -80,7 +159,7 @@ void worker_print_cputime(struct worker *w, struct rusage *ru, const char *x)
         user_total += user;
         sys_total += sys;
 
-        fprintf(stderr, "   %3s    %.1fs user, %.1fs system\n",
+        fprintf(out, "   %3s    %.1fs user, %.1fs system\n",
                 x, user, sys);
     }
 
@@ -92,11 +171,11 @@ void worker_print_cputime(struct worker *w, struct rusage *ru, const char *x)
         user_total += user;
         sys_total += sys;
 
-        fprintf(stderr, "   %3d    %.1fs user, %.1fs system\n",
+        fprintf(out, "   %3d    %.1fs user, %.1fs system\n",
                 i, user, sys);
     }
 
-    fprintf(stderr, "   Tot    %.1fs user, %.1fs system\n",
+    fprintf(out, "   Tot    %.1fs user, %.1fs system\n",
             user_total, sys_total);
 }
 
@@ -105,6 +184,8 @@ void worker_join(struct worker *w)
 {
     for (int i = 0; i < w->num_threads; i++)
         pthread_join(w->threads[i], NULL);
+
+    sem_destroy(&w->gate);
 }
 
 void worker_free(struct worker *w)
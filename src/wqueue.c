@@ -28,45 +28,311 @@
 #include "wed.h"
 #include "wqueue_emul.h"
 #include "capi.h"
+#include "macro.h"
+#include "utils.h"
+#include "hist.h"
+#include "topo.h"
+#include "trace.h"
+#include "crc32c.h"
 
 #include <libcxl.h>
 
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
 
-static struct wed *wed;
-static unsigned wed_push = 0;
-static unsigned wed_pop = 0;
-static size_t queue_len;
-static struct wqueue_mmio *mmio;
-static struct cxl_afu_h *afu_h;
+// Producers don't share a lock. Each one claims a range of tickets from
+// push_ticket, where ticket t lives in slot t % queue_len and is free
+// once t < pop_count + queue_len. Descriptors are filled concurrently
+// but the ready flags are set strictly in ticket order: a producer waits
+// until published reaches its first ticket before flipping its flags so
+// the hardware never sees a ready entry after a gap. push_mutex and
+// push_condition are only used by producers that find the ring full or
+// that are left waiting on a producer that did.
+// Producers fold their descriptors into one of several accumulators,
+// each on its own cache line, which are combined when read
+#define XOR_STRIPES 16
+
+struct xor_stripe {
+    uint64_t sum;
+    char pad[CAPI_CACHELINE_BYTES - sizeof(uint64_t)];
+};
+
+static __thread unsigned my_stripe = -1;
+static unsigned next_stripe;
+
+// Fields are grouped by who writes them. Each side keeps a cached copy
+// of the other's index and only goes back to the shared one when the
+// copy says it has to wait.
+//
+// Configuring with --wqueue-split also starts each group on its own
+// cache line so the producer and consumer sides only meet at the ring
+// itself. That is off by default as wqueue-bench has yet to show it
+// paying for the extra lines each operation then touches.
+#ifdef WQUEUE_SPLIT_LAYOUT
+#define __wq_line __cacheline_aligned
+#else
+#define __wq_line
+#endif
+
+struct timer_calib {
+    uint64_t host_ns;
+    uint32_t ticks;
+};
+
+struct wqueue {
+    // Read mostly, set up at init
+    struct wed *wed;
+    struct capi_mem wed_mem;
+    int afu_node;
+    size_t queue_len;
+    struct wqueue_mmio *mmio;
+    struct cxl_afu_h *afu_h;
+    struct wqueue_poll poll;
+    enum wqueue_doorbell doorbell;
+    int checksum;
+    int hist_enabled;
+    struct hist *hist[WQ_HIST_TYPES];
+
+    // Producers
+    uint64_t push_ticket __wq_line;
+    uint64_t published;
+    uint64_t cached_limit;          // stale copy of pop_count + queue_len
+    int doorbell_owed;
+    uint64_t doorbells_rung;
+    uint64_t doorbells_elided;
+
+    // Producers blocked on a full ring or on an earlier producer, only
+    // touched on the slow path
+    int push_waiters __wq_line;
+    pthread_mutex_t push_mutex;
+    pthread_cond_t push_condition;
+
+    // Consumers
+    pthread_mutex_t pop_mutex __wq_line;
+    unsigned wed_pop;
+    uint64_t pop_count;
+    uint64_t cached_published;      // stale copy of published
+    uint64_t avg_service_ns;
+    struct timer_calib calib;
+    int event_fd;
+    int event_stop;
+    int event_thread_running;
+    pthread_t event_thrd;
+
+    struct xor_stripe xor_sum[XOR_STRIPES] __wq_line;
+};
+
+enum {
+    WQ_LARGE_MIN_CHUNK = 64 << 10,
+    WQ_LARGE_MAX_CHUNK = 4 << 20,
+    WQ_LARGE_BATCH = 16,
+    WQ_SG_BATCH = 16,
+    WQ_CRC_BATCH = 16,
+};
+
+// Set on a popped item while it is handed from harvest() to
+// finish_items(); above the 16 bits of WED flags so it can't clash
+#define ITEM_CHAINED_FLAG (1 << 16)
+
+struct wqueue_group {
+    struct wqueue_item result;
+    size_t chunks;
+    size_t harvested;
+};
+
+#define NS_PER_TICK (1000000000ULL / CAPI_TIMER_FREQ)
+#define CALIBRATE_INTERVAL_NS 1000000000ULL
+
+static const struct wqueue_poll default_poll = {
+    .mode = WQ_POLL_ADAPTIVE,
+    .spin_us = 50,
+    .min_sleep_us = 1,
+    .max_sleep_us = 10000,
+    .timeout_ms = 10000,
+};
+
+static void kick_owed(struct wqueue *wq);
+static void wake_producers(struct wqueue *wq);
+
+struct poller {
+    struct wqueue *wq;
+    struct wqueue_poll cfg;
+    uint64_t start_ns;
+    uint64_t spin_ns;
+    unsigned sleep_us;
+};
+
+// Must be called with pop_mutex held so the poll settings and service
+// time estimate are consistent.
+static void poll_start(struct wqueue *wq, struct poller *p)
+{
+    p->wq = wq;
+    p->cfg = wq->poll;
+    p->start_ns = utils_monotonic_ns();
+    p->spin_ns = p->cfg.spin_us * 1000ULL;
+    p->sleep_us = p->cfg.min_sleep_us;
+
+    if (p->cfg.mode != WQ_POLL_ADAPTIVE || !wq->avg_service_ns)
+        return;
+
+    // Don't spin for much longer than a typical item takes and start
+    // backing off at a fraction of it so short items are picked up
+    // quickly while long ones don't burn the CPU.
+    if (p->spin_ns > 2 * wq->avg_service_ns)
+        p->spin_ns = 2 * wq->avg_service_ns;
+
+    uint64_t sleep_us = wq->avg_service_ns / 4000;
+    if (sleep_us > p->sleep_us)
+        p->sleep_us = sleep_us;
+    if (p->sleep_us > p->cfg.max_sleep_us)
+        p->sleep_us = p->cfg.max_sleep_us;
+}
+
+static int poll_wait(struct poller *p)
+{
+    uint64_t elapsed = utils_monotonic_ns() - p->start_ns;
+
+    if (p->cfg.timeout_ms && elapsed >= p->cfg.timeout_ms * 1000000ULL)
+        return -1;
+
+    switch (p->cfg.mode) {
+    case WQ_POLL_SPIN:
+        cpu_relax();
+        return 0;
+    case WQ_POLL_SLEEP:
+        kick_owed(p->wq);
+        usleep(p->cfg.max_sleep_us);
+        return 0;
+    case WQ_POLL_ADAPTIVE:
+        break;
+    }
+
+    if (elapsed < p->spin_ns) {
+        cpu_relax();
+        return 0;
+    }
+
+    kick_owed(p->wq);
+    usleep(p->sleep_us);
 
-static pthread_mutex_t push_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t push_condition = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t pop_mutex = PTHREAD_MUTEX_INITIALIZER;
+    p->sleep_us *= 2;
+    if (p->sleep_us == 0)
+        p->sleep_us = 1;
+    if (p->sleep_us > p->cfg.max_sleep_us)
+        p->sleep_us = p->cfg.max_sleep_us;
 
-static uint64_t xor_sum;
+    return 0;
+}
+
+static inline int hist_on(struct wqueue *wq)
+{
+    return __atomic_load_n(&wq->hist_enabled, __ATOMIC_RELAXED);
+}
+
+static void update_service_time(struct wqueue *wq, const struct wed *w,
+                                int hist)
+{
+    uint32_t cycles = w->end_time - w->start_time;
+    uint64_t ns = cycles * NS_PER_TICK;
+
+    if (hist)
+        hist_record(wq->hist[WQ_HIST_SERVICE], ns);
+
+    if (!wq->avg_service_ns)
+        wq->avg_service_ns = ns;
+    else
+        wq->avg_service_ns += ((int64_t) ns -
+                               (int64_t) wq->avg_service_ns) / 8;
+}
 
-static int afu_init(char *cxl_dev)
+// Pairs a reading of the AFU's free running timer with the host's
+// monotonic clock so host timestamps can be compared with the 32 bit
+// start and end times the AFU writes into the WED.
+static void calibrate_timer(struct wqueue *wq, struct timer_calib *c)
 {
-    afu_h = cxl->afu_open_dev (cxl_dev);
-    if (afu_h == NULL) {
+    uint64_t timer = 0;
+    uint64_t before = utils_monotonic_ns();
+    cxl->mmio_read64(wq->afu_h, &wq->mmio->timer, &timer);
+    uint64_t after = utils_monotonic_ns();
+
+    c->host_ns = before + (after - before) / 2;
+    c->ticks = timer;
+}
+
+// The calibration is redone periodically from the pop path so the two
+// clocks don't drift apart, but only while the histograms or the tracer
+// use it. The MMIO read is slow so it happens before pop_mutex is taken
+// and the result is installed under the lock with install_calib().
+static int recalibrate(struct wqueue *wq, struct timer_calib *c)
+{
+    if (!hist_on(wq) && !trace_enabled())
+        return 0;
+
+    uint64_t last = __atomic_load_n(&wq->calib.host_ns, __ATOMIC_RELAXED);
+    if (utils_monotonic_ns() - last <= CALIBRATE_INTERVAL_NS)
+        return 0;
+
+    calibrate_timer(wq, c);
+    return 1;
+}
+
+// Must be called with pop_mutex held
+static void install_calib(struct wqueue *wq, const struct timer_calib *c)
+{
+    if (c->host_ns <= wq->calib.host_ns)
+        return;
+
+    wq->calib.ticks = c->ticks;
+    __atomic_store_n(&wq->calib.host_ns, c->host_ns, __ATOMIC_RELAXED);
+}
+
+static uint32_t host_to_ticks(struct wqueue *wq, uint64_t ns)
+{
+    int64_t delta = ns - wq->calib.host_ns;
+
+    return wq->calib.ticks + delta / (int64_t) NS_PER_TICK;
+}
+
+static uint64_t ticks_to_host(struct wqueue *wq, uint32_t ticks)
+{
+    int32_t delta = ticks - wq->calib.ticks;
+
+    return wq->calib.host_ns + (int64_t) delta * NS_PER_TICK;
+}
+
+// Records the signed difference between two AFU timer values, clamping
+// the small negative values calibration error can produce to zero.
+static void record_ticks(struct hist *h, uint32_t from, uint32_t to)
+{
+    int32_t ticks = to - from;
+
+    hist_record(h, ticks > 0 ? ticks * NS_PER_TICK : 0);
+}
+
+static int afu_init(struct wqueue *wq, char *cxl_dev)
+{
+    wq->afu_h = cxl->afu_open_dev (cxl_dev);
+    if (wq->afu_h == NULL) {
         fprintf(stderr, "ERROR: cannot open AFU device '%s': %s\n",
                 cxl_dev, strerror(errno));
         return -1;
     }
 
-    if (cxl->afu_attach (afu_h, (uint64_t) wed)) {
+    if (cxl->afu_attach (wq->afu_h, (uint64_t) wq->wed)) {
         fprintf(stderr, "ERROR: could not attach to AFU device '%s': %s\n",
                 cxl_dev, strerror(errno));
         goto close_afu;
     }
 
-    if ((cxl->mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN)) < 0) {
+    if ((cxl->mmio_map(wq->afu_h, CXL_MMIO_BIG_ENDIAN)) < 0) {
         fprintf(stderr, "ERROR: could not map the MMIO memory on  AFU device '%s': %s\n",
                 cxl_dev, strerror(errno));
         goto close_afu;
@@ -75,60 +341,149 @@ static int afu_init(char *cxl_dev)
     return 0;
 
 close_afu:
-    cxl->afu_free(afu_h);
+    cxl->afu_free(wq->afu_h);
     return -1;
 }
 
-int wqueue_init(char *cxl_dev, struct wqueue_mmio *_mmio, size_t _queue_len)
+struct wqueue *wqueue_init(char *cxl_dev, struct wqueue_mmio *mmio,
+                           size_t queue_len)
 {
-    int ret = posix_memalign((void**) &wed, CAPI_CACHELINE_BYTES,
-                             _queue_len * sizeof(*wed));
-    if (ret || wed == NULL) {
-        errno = ret;
+    struct wqueue_opts opts = {
+        .queue_len = queue_len,
+        .wed_backing = CAPI_BACKING_NORMAL,
+    };
+
+    return wqueue_init_opts(cxl_dev, mmio, &opts);
+}
+
+struct wqueue *wqueue_init_opts(char *cxl_dev, struct wqueue_mmio *mmio,
+                                const struct wqueue_opts *opts)
+{
+    size_t queue_len = opts->queue_len;
+    struct wqueue *wq = capi_alloc(sizeof(*wq));
+    if (wq == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&wq->push_mutex, NULL))
+        goto free_wq;
+
+    if (pthread_cond_init(&wq->push_condition, NULL))
+        goto destroy_push_mutex;
+
+    if (pthread_mutex_init(&wq->pop_mutex, NULL))
+        goto destroy_push_condition;
+
+    size_t ring_len = queue_len * sizeof(*wq->wed);
+    enum capi_backing backing = opts->wed_backing;
+    if (backing >= CAPI_BACKING_HUGE_1G && ring_len < CAPI_HUGE_1G_MIN_BYTES)
+        backing = CAPI_BACKING_HUGE_2M;
+
+    // The AFU reads and writes the ring constantly so keep it local to
+    // the card when we know where that is
+    wq->afu_node = topo_afu_node(cxl_dev);
+    if (capi_alloc_pages_node(&wq->wed_mem, ring_len, backing,
+                              wq->afu_node))
+    {
         perror("allocating wed");
-        return -1;
+        goto destroy_pop_mutex;
     }
+    wq->wed = wq->wed_mem.addr;
 
-    memset(wed, 0, _queue_len * sizeof(*wed));
+    memset(wq->wed, 0, ring_len);
 
-    if (afu_init(cxl_dev))
-        goto free_wed;
+    int i;
+    for (i = 0; i < WQ_HIST_TYPES; i++) {
+        wq->hist[i] = hist_new();
+        if (wq->hist[i] == NULL)
+            goto free_hists;
+    }
 
-    xor_sum = 0;
-    mmio = _mmio;
-    wed_push = wed_pop = 0;
-    queue_len = _queue_len;
-    cxl->mmio_write64(afu_h, &mmio->queue_len, queue_len-1);
+    if (afu_init(wq, cxl_dev))
+        goto free_hists;
 
-    return 0;
+    memset(wq->xor_sum, 0, sizeof(wq->xor_sum));
+    wq->checksum = 0;
+    wq->hist_enabled = 0;
+    wq->poll = default_poll;
+    wq->doorbell = WQ_DOORBELL_AUTO;
+    wq->doorbell_owed = 0;
+    wq->doorbells_rung = wq->doorbells_elided = 0;
+    wq->avg_service_ns = 0;
+    wq->pop_count = 0;
+    wq->event_fd = -1;
+    wq->event_thread_running = 0;
+    wq->mmio = mmio;
+    wq->wed_pop = 0;
+    wq->push_ticket = wq->published = 0;
+    wq->cached_limit = queue_len;
+    wq->cached_published = 0;
+    wq->push_waiters = 0;
+    wq->queue_len = queue_len;
+    cxl->mmio_write64(wq->afu_h, &wq->mmio->queue_len, queue_len-1);
 
-free_wed:
-    free(wed);
-    return -1;
+    calibrate_timer(wq, &wq->calib);
+
+    return wq;
+
+free_hists:
+    while (i--)
+        hist_free(wq->hist[i]);
+    capi_free_pages(&wq->wed_mem);
+destroy_pop_mutex:
+    pthread_mutex_destroy(&wq->pop_mutex);
+destroy_push_condition:
+    pthread_cond_destroy(&wq->push_condition);
+destroy_push_mutex:
+    pthread_mutex_destroy(&wq->push_mutex);
+free_wq:
+    free(wq);
+    return NULL;
 }
 
-void wqueue_cleanup(void)
+void wqueue_cleanup(struct wqueue *wq)
 {
-    cxl->mmio_write64(afu_h, &mmio->force_stop, 1);
-    cxl->afu_free(afu_h);
-    free(wed);
+    if (wq->event_thread_running) {
+        pthread_mutex_lock(&wq->pop_mutex);
+        wq->event_stop = 1;
+        pthread_mutex_unlock(&wq->pop_mutex);
+        pthread_join(wq->event_thrd, NULL);
+    }
+
+    cxl->mmio_write64(wq->afu_h, &wq->mmio->force_stop, 1);
+    cxl->afu_free(wq->afu_h);
+    capi_free_pages(&wq->wed_mem);
+
+    if (wq->event_fd >= 0)
+        close(wq->event_fd);
+
+    for (int i = 0; i < WQ_HIST_TYPES; i++)
+        hist_free(wq->hist[i]);
+
+    pthread_mutex_destroy(&wq->pop_mutex);
+    pthread_cond_destroy(&wq->push_condition);
+    pthread_mutex_destroy(&wq->push_mutex);
+    free(wq);
 }
 
-static inline unsigned next_wed(unsigned x)
+static inline unsigned next_wed(struct wqueue *wq, unsigned x)
 {
     x++;
-    if (x == queue_len)
+    if (x == wq->queue_len)
         return 0;
     return x;
 }
 
-static void calc_xor(uint64_t *x)
+static uint64_t calc_xor(uint64_t *x)
 {
+    uint64_t ret = 0;
+
     for (int i = 0; i < sizeof(struct wed) / sizeof(uint64_t); i++)
-        xor_sum ^= x[i];
+        ret ^= x[i];
+
+    return ret;
 }
 
-void wqueue_push(const struct wqueue_item *qitem)
+static int item_flags(const struct wqueue_item *qitem)
 {
     int flags = qitem->flags;
     flags &= ~WQ_DONE_FLAG;
@@ -137,84 +492,852 @@ void wqueue_push(const struct wqueue_item *qitem)
     if (qitem->src != qitem->dst)
         flags |= WQ_ALWAYS_WRITE_FLAG;
 
-    pthread_mutex_lock(&push_mutex);
+    return flags;
+}
+
+// Fills everything in the WED except the flags which get published
+// separately after a barrier. Returns the descriptor's contribution to
+// the XOR sum.
+static uint64_t fill_wed(struct wed *w, const struct wqueue_item *qitem,
+                         int flags, size_t chain_left,
+                         struct wqueue_group *group, uint64_t push_ns,
+                         uint32_t src_crc)
+{
+    w->error_code = 0;
+    w->src = qitem->src;
+    w->dst = qitem->dst;
+    w->chunk_length = qitem->src_len / CAPI_CACHELINE_BYTES;
+    w->src_len = qitem->src_len;
+    w->opaque = qitem->opaque;
+    w->chain_left = chain_left;
+    w->group = group;
+    w->push_ns = push_ns;
+    w->src_crc = src_crc;
+
+    return calc_xor((uint64_t *) w) ^ flags;
+}
+
+static inline uint64_t push_limit(struct wqueue *wq)
+{
+    return __atomic_load_n(&wq->pop_count, __ATOMIC_ACQUIRE) +
+        wq->queue_len;
+}
+
+static inline void update_limit(struct wqueue *wq, uint64_t limit)
+{
+    if (limit > __atomic_load_n(&wq->cached_limit, __ATOMIC_RELAXED))
+        __atomic_store_n(&wq->cached_limit, limit, __ATOMIC_RELAXED);
+}
+
+// Returns a push limit above ticket or zero if its slot isn't free yet.
+// The cached limit is checked first so producers only read the
+// consumers' pop_count line when the ring looks full. The cache only
+// ever lags the real limit, which is conservative.
+static inline uint64_t free_limit(struct wqueue *wq, uint64_t ticket)
+{
+    uint64_t limit = __atomic_load_n(&wq->cached_limit, __ATOMIC_RELAXED);
+    if (ticket < limit)
+        return limit;
+
+    limit = push_limit(wq);
+    update_limit(wq, limit);
+
+    return ticket < limit ? limit : 0;
+}
+
+static uint64_t wait_free(struct wqueue *wq, uint64_t ticket)
+{
+    uint64_t limit;
+
+    for (int i = 0; i < 256; i++) {
+        if ((limit = free_limit(wq, ticket)))
+            return limit;
+        cpu_relax();
+    }
+
+    uint64_t trace_start = trace_begin();
+
+    kick_owed(wq);
+    pthread_mutex_lock(&wq->push_mutex);
+    __atomic_add_fetch(&wq->push_waiters, 1, __ATOMIC_SEQ_CST);
+
+    while (ticket >= (limit = __atomic_load_n(&wq->pop_count,
+                                              __ATOMIC_SEQ_CST) +
+                      wq->queue_len))
+        pthread_cond_wait(&wq->push_condition, &wq->push_mutex);
+
+    __atomic_sub_fetch(&wq->push_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&wq->push_mutex);
+
+    update_limit(wq, limit);
+    trace_span("wq full", trace_start, ticket);
+
+    return limit;
+}
+
+// The previous producer is only ever filling in a few descriptors so
+// this is normally short. If it isn't, that producer is most likely
+// asleep on a full ring, so sleep on the same condition rather than
+// yield: publish() wakes push waiters each time published moves.
+static void wait_published(struct wqueue *wq, uint64_t ticket)
+{
+    for (int i = 0; i < 1024; i++) {
+        if (__atomic_load_n(&wq->published, __ATOMIC_ACQUIRE) == ticket)
+            return;
+        cpu_relax();
+    }
+
+    uint64_t trace_start = trace_begin();
+
+    pthread_mutex_lock(&wq->push_mutex);
+    __atomic_add_fetch(&wq->push_waiters, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&wq->published, __ATOMIC_SEQ_CST) != ticket)
+        pthread_cond_wait(&wq->push_condition, &wq->push_mutex);
+
+    __atomic_sub_fetch(&wq->push_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&wq->push_mutex);
+
+    trace_span("wq publish wait", trace_start, ticket);
+}
+
+static void kick(struct wqueue *wq)
+{
+    cxl->mmio_write64(wq->afu_h, &wq->mmio->trigger, 1);
+    __atomic_add_fetch(&wq->doorbells_rung, 1, __ATOMIC_RELAXED);
+}
+
+// Ring the trigger if any push since the last one skipped it. Called
+// whenever a consumer is about to sleep or comes up empty, in case the
+// AFU stopped without us noticing.
+static void kick_owed(struct wqueue *wq)
+{
+    if (__atomic_load_n(&wq->doorbell_owed, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&wq->doorbell_owed, 0, __ATOMIC_RELAXED))
+        kick(wq);
+}
+
+// The AFU only needs the trigger when it has stopped on an entry that
+// wasn't ready. It works through the ring in order, so if the entry
+// before ours is still ready and not done, the AFU has yet to finish it
+// and will read our entry afterwards. The caller has already stored
+// our flags and issued a full barrier, so the AFU is sure to see them
+// once it marks that entry done. A one entry ring has no entry before
+// ours, only the slot we just published, so it always rings.
+static void ring_doorbell(struct wqueue *wq, unsigned first)
+{
+    if (__atomic_load_n(&wq->doorbell, __ATOMIC_RELAXED) ==
+        WQ_DOORBELL_AUTO && wq->queue_len > 1)
+    {
+        unsigned prev = first ? first - 1 : wq->queue_len - 1;
+        int flags = __atomic_load_n(&wq->wed[prev].flags, __ATOMIC_RELAXED);
+
+        if ((flags & WQ_READY_FLAG) && !(flags & WQ_DONE_FLAG)) {
+            __atomic_add_fetch(&wq->doorbells_elided, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&wq->doorbell_owed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    kick(wq);
+}
 
-    while(wed[wed_push].flags)
-        pthread_cond_wait(&push_condition, &push_mutex);
+// The caller owns tickets [ticket, ticket + count) and all of their
+// slots must be free. chain_left is the number of entries that follow
+// qitems[0] in a scatter-gather chain or zero if these are independent
+// items. group is set for the sub-chunks of a large submission.
+// src_crcs holds an input CRC per entry in checksum mode and is NULL
+// otherwise.
+static void publish(struct wqueue *wq, uint64_t ticket,
+                    const struct wqueue_item *qitems, size_t count,
+                    size_t chain_left, struct wqueue_group *group,
+                    const uint32_t *src_crcs)
+{
+    unsigned first = ticket % wq->queue_len;
+    unsigned idx = first;
+    uint64_t xor_sum = 0;
+    uint64_t now = hist_on(wq) ? utils_monotonic_ns() : 0;
+    uint64_t trace_start = trace_begin();
+
+    for (size_t i = 0; i < count; i++) {
+        xor_sum ^= fill_wed(&wq->wed[idx], &qitems[i],
+                            item_flags(&qitems[i]),
+                            chain_left ? chain_left - i : 0, group, now,
+                            src_crcs ? src_crcs[i] : 0);
+        idx = next_wed(wq, idx);
+    }
 
-    wed[wed_push].error_code = 0;
-    wed[wed_push].src = qitem->src;
-    wed[wed_push].dst = qitem->dst;
-    wed[wed_push].chunk_length = qitem->src_len / CAPI_CACHELINE_BYTES;
-    wed[wed_push].src_len = qitem->src_len;
-    wed[wed_push].opaque = qitem->opaque;
+    if (my_stripe >= XOR_STRIPES)
+        my_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) %
+            XOR_STRIPES;
+    __atomic_fetch_xor(&wq->xor_sum[my_stripe].sum, xor_sum,
+                       __ATOMIC_RELAXED);
 
-    calc_xor((uint64_t *) &wed[wed_push]);
-    xor_sum ^= flags;
+    wait_published(wq, ticket);
 
     __sync_synchronize ();
-    wed[wed_push].flags = flags;
+
+    idx = first;
+    for (size_t i = 0; i < count; i++) {
+        wq->wed[idx].flags = item_flags(&qitems[i]);
+        idx = next_wed(wq, idx);
+    }
+
     __sync_synchronize ();
 
-    cxl->mmio_write64(afu_h, &mmio->trigger, 1);
+    __atomic_store_n(&wq->published, ticket + count, __ATOMIC_SEQ_CST);
+
+    ring_doorbell(wq, first);
+    wake_producers(wq);
+
+    trace_span("wq publish", trace_start, count);
+}
+
+static inline int checksum_on(struct wqueue *wq)
+{
+    return __atomic_load_n(&wq->checksum, __ATOMIC_RELAXED);
+}
+
+static uint32_t src_crc(const struct wqueue_item *qitem)
+{
+    if (qitem->src == NULL || (qitem->flags & WQ_WRITE_ONLY_FLAG))
+        return 0;
+
+    return crc32c(0, qitem->src, qitem->src_len);
+}
+
+static void push_claimed(struct wqueue *wq, const struct wqueue_item *qitems,
+                         size_t n, struct wqueue_group *group,
+                         const uint32_t *src_crcs)
+{
+    uint64_t ticket = __atomic_fetch_add(&wq->push_ticket, n,
+                                         __ATOMIC_RELAXED);
+
+    while (n) {
+        size_t count = wait_free(wq, ticket) - ticket;
+        if (count > n)
+            count = n;
+
+        publish(wq, ticket, qitems, count, 0, group, src_crcs);
+        ticket += count;
+        qitems += count;
+        n -= count;
+        if (src_crcs)
+            src_crcs += count;
+    }
+}
+
+// In checksum mode the inputs are hashed a batch at a time before
+// their tickets are claimed, so the producers queued behind us never
+// wait on the hashing and the CRC is of the data the AFU was given.
+static void push_items(struct wqueue *wq, const struct wqueue_item *qitems,
+                       size_t n, struct wqueue_group *group)
+{
+    uint32_t crcs[WQ_CRC_BATCH];
+
+    if (!checksum_on(wq)) {
+        push_claimed(wq, qitems, n, group, NULL);
+        return;
+    }
+
+    while (n) {
+        size_t count = n < WQ_CRC_BATCH ? n : WQ_CRC_BATCH;
+
+        for (size_t i = 0; i < count; i++)
+            crcs[i] = src_crc(&qitems[i]);
+
+        push_claimed(wq, qitems, count, group, crcs);
+        qitems += count;
+        n -= count;
+    }
+}
+
+void wqueue_push(struct wqueue *wq, const struct wqueue_item *qitem)
+{
+    push_items(wq, qitem, 1, NULL);
+}
+
+void wqueue_push_batch(struct wqueue *wq, const struct wqueue_item *qitems,
+                       size_t n)
+{
+    push_items(wq, qitems, n, NULL);
+}
+
+static int sg_aligned(const struct iovec *iov)
+{
+    return !((uintptr_t) iov->iov_base % CAPI_CACHELINE_BYTES) &&
+        !(iov->iov_len % CAPI_CACHELINE_BYTES);
+}
+
+// Splits one logical item into a chain of WED entries, one per iovec.
+// Each entry records how many entries follow it in chain_left so the
+// consumer can wait for the whole chain and return it as one item. The
+// chain has to fit in the ring at once. If dst is NULL the segments are
+// processed in place. The AFU works in whole cache lines, so every
+// segment must start on one and be a multiple of one long.
+int wqueue_push_sg(struct wqueue *wq, const struct wqueue_item *qitem,
+                   const struct iovec *src, const struct iovec *dst,
+                   int iovcnt)
+{
+    if (iovcnt <= 0 || iovcnt > wq->queue_len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (!sg_aligned(&src[i]) ||
+            (dst != NULL && (!sg_aligned(&dst[i]) ||
+                             dst[i].iov_len < src[i].iov_len)))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    // The chain's input CRC covers every segment and rides in its head
+    // entry
+    uint32_t crcs[WQ_SG_BATCH] = {0};
+    int checksum = checksum_on(wq);
+
+    if (checksum && !(qitem->flags & WQ_WRITE_ONLY_FLAG))
+        for (int i = 0; i < iovcnt; i++)
+            crcs[0] = crc32c(crcs[0], src[i].iov_base, src[i].iov_len);
+
+    // The whole chain takes consecutive tickets but the entries are
+    // built a batch at a time as their slots come free.
+    uint64_t ticket = __atomic_fetch_add(&wq->push_ticket, iovcnt,
+                                         __ATOMIC_RELAXED);
+    struct wqueue_item segs[WQ_SG_BATCH];
+    int done = 0;
+
+    while (done < iovcnt) {
+        size_t count = wait_free(wq, ticket) - ticket;
+        if (count > iovcnt - done)
+            count = iovcnt - done;
+        if (count > WQ_SG_BATCH)
+            count = WQ_SG_BATCH;
+
+        for (size_t i = 0; i < count; i++) {
+            const struct iovec *s = &src[done + i];
+
+            segs[i] = *qitem;
+            segs[i].src = s->iov_base;
+            segs[i].dst = dst != NULL ? dst[done + i].iov_base : s->iov_base;
+            segs[i].src_len = s->iov_len;
+        }
+
+        publish(wq, ticket, segs, count, iovcnt - done - 1, NULL,
+                checksum ? crcs : NULL);
+        ticket += count;
+        done += count;
+        crcs[0] = 0;
+    }
+
+    return 0;
+}
+
+// Picks a sub-chunk size that gives a few chunks in flight per ring
+// without making each completion too small to be worth harvesting.
+static size_t large_chunk_len(struct wqueue *wq, size_t len)
+{
+    size_t chunk = len / (wq->queue_len / 2 ? wq->queue_len / 2 : 1);
+
+    if (chunk < WQ_LARGE_MIN_CHUNK)
+        chunk = WQ_LARGE_MIN_CHUNK;
+    if (chunk > WQ_LARGE_MAX_CHUNK)
+        chunk = WQ_LARGE_MAX_CHUNK;
+
+    return chunk;
+}
+
+// Slices a large buffer into sub-chunks and queues them all, blocking
+// while the ring is full, so the hardware works on the early chunks
+// while the later ones are still being queued. The sub-chunks share a
+// group that the pop side folds them into; it hands back a single item
+// with the caller's src, dst and opaque, the total dst_len, the OR of
+// the dirty flags and the first non-zero error code. A chunk_len of
+// zero picks a size based on the ring length. If dst is NULL the buffer
+// is processed in place.
+int wqueue_submit_large(struct wqueue *wq, const struct wqueue_item *qitem,
+                        size_t chunk_len)
+{
+    if (!chunk_len)
+        chunk_len = large_chunk_len(wq, qitem->src_len);
+
+    chunk_len = (chunk_len + CAPI_CACHELINE_BYTES - 1) &
+        ~(CAPI_CACHELINE_BYTES - 1);
+
+    // A buffer that fits in one chunk needs no group to fold it back
+    // together, so it goes straight in as a normal item.
+    if (qitem->src_len <= chunk_len) {
+        struct wqueue_item one = *qitem;
+        if (one.dst == NULL)
+            one.dst = (void *) one.src;
 
-    wed_push = next_wed(wed_push);
+        wqueue_push(wq, &one);
+        return 0;
+    }
+
+    struct wqueue_group *g = malloc(sizeof(*g));
+    if (g == NULL)
+        return -1;
+
+    g->result = *qitem;
+    if (g->result.dst == NULL)
+        g->result.dst = (void *) qitem->src;
+    g->result.dst_len = 0;
+    g->chunks = (qitem->src_len + chunk_len - 1) / chunk_len;
+    g->harvested = 0;
+
+    struct wqueue_item chunks[WQ_LARGE_BATCH];
+    size_t off = 0;
 
-    pthread_mutex_unlock(&push_mutex);
+    while (off < qitem->src_len) {
+        size_t n;
+        for (n = 0; n < WQ_LARGE_BATCH && off < qitem->src_len; n++) {
+            size_t len = qitem->src_len - off;
+            if (len > chunk_len)
+                len = chunk_len;
+
+            chunks[n] = *qitem;
+            chunks[n].src = qitem->src ? (const char *) qitem->src + off : NULL;
+            chunks[n].dst = qitem->dst ? (char *) qitem->dst + off :
+                (void *) chunks[n].src;
+            chunks[n].src_len = len;
+
+            off += len;
+        }
+
+        // The group may be freed by the consumer as soon as the last
+        // chunk is pushed so it must not be touched after this.
+        push_items(wq, chunks, n, g);
+    }
+
+    return 0;
 }
 
-int wqueue_pop(struct wqueue_item *qitem)
+int wqueue_try_push(struct wqueue *wq, const struct wqueue_item *qitem)
 {
-    int ret = 0;
-    int timeout_counter = 0;
+    uint64_t ticket = __atomic_load_n(&wq->push_ticket, __ATOMIC_RELAXED);
+    uint32_t crc = 0;
 
-    while (1) {
-        pthread_mutex_lock(&pop_mutex);
+    if (!free_limit(wq, ticket)) {
+        errno = EAGAIN;
+        return -1;
+    }
 
-        if (wed[wed_pop].flags & WQ_DONE_FLAG)
-            break;
+    // Hashed once there looks to be room, so a full ring fails fast,
+    // but before the ticket is claimed
+    int checksum = checksum_on(wq);
+    if (checksum)
+        crc = src_crc(qitem);
 
-        pthread_mutex_unlock(&pop_mutex);
-        timeout_counter++;
-        if (timeout_counter >= 1000)
+    while (!__atomic_compare_exchange_n(&wq->push_ticket, &ticket,
+                                        ticket + 1, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+    {
+        if (!free_limit(wq, ticket)) {
+            errno = EAGAIN;
             return -1;
-        usleep(10000);
+        }
     }
 
-    timeout_counter = 0;
-    qitem->src = wed[wed_pop].src;
-    qitem->dst = wed[wed_pop].dst;
-    qitem->src_len = wed[wed_pop].src_len;
-    qitem->dst_len = wed[wed_pop].chunk_length * CAPI_CACHELINE_BYTES;
-    qitem->flags = wed[wed_pop].flags;
-    qitem->start_time = wed[wed_pop].start_time;
-    qitem->end_time = wed[wed_pop].end_time;
-    qitem->opaque = wed[wed_pop].opaque;
-    ret = wed[wed_pop].error_code;
+    publish(wq, ticket, qitem, 1, 0, NULL, checksum ? &crc : NULL);
+
+    return 0;
+}
+
+// hist is set when the latencies are being recorded, in which case
+// pop_ticks is the harvest time on the AFU's clock.
+static void read_wed(struct wqueue *wq, struct wed *w,
+                     struct wqueue_item *qitem, int hist, uint32_t pop_ticks)
+{
+    qitem->src = w->src;
+    qitem->dst = w->dst;
+    qitem->src_len = w->src_len;
+    qitem->dst_len = w->chunk_length * CAPI_CACHELINE_BYTES;
+    qitem->flags = w->flags;
+    qitem->start_time = w->start_time;
+    qitem->end_time = w->end_time;
+    qitem->opaque = w->opaque;
+    qitem->error_code = w->error_code;
+    qitem->src_crc = w->src_crc;
+    qitem->dst_crc = 0;
+
+    update_service_time(wq, w, hist);
+
+    if (hist) {
+        // Entries pushed before the histograms were turned on have no
+        // push time
+        if (w->push_ns)
+            record_ticks(wq->hist[WQ_HIST_QUEUE],
+                         host_to_ticks(wq, w->push_ns), w->start_time);
+        record_ticks(wq->hist[WQ_HIST_PICKUP], w->end_time, pop_ticks);
+    }
+
+    if (trace_enabled()) {
+        int32_t ticks = w->end_time - w->start_time;
+        trace_record('X', TRACE_TRACK_AFU, "afu", ticks_to_host(wq,
+                     w->start_time), ticks > 0 ? ticks * NS_PER_TICK : 0,
+                     w->src_len);
+    }
+}
+
+static inline int head_done(struct wqueue *wq, unsigned idx)
+{
+    return __atomic_load_n(&wq->wed[idx].flags, __ATOMIC_ACQUIRE) &
+        WQ_DONE_FLAG;
+}
+
+static inline unsigned wed_add(struct wqueue *wq, unsigned idx, unsigned n)
+{
+    idx += n;
+    if (idx >= wq->queue_len)
+        idx -= wq->queue_len;
+    return idx;
+}
+
+// An item is done once the last entry of its chain is done. The
+// hardware completes entries in order so that covers the whole chain.
+// chain_left is only valid once the head entry is done. avail is the
+// number of slots from idx that haven't been harvested yet: a chain can
+// be published in pieces so a tail beyond that would be a stale entry.
+static inline int item_done(struct wqueue *wq, unsigned idx, size_t avail)
+{
+    if (!head_done(wq, idx))
+        return 0;
+
+    unsigned chain_left = wq->wed[idx].chain_left;
+    if (chain_left >= avail)
+        return 0;
+
+    return head_done(wq, wed_add(wq, idx, chain_left));
+}
+
+// Must be called with pop_mutex held. Nothing can be ready if every
+// published entry has been harvested, which the cached copy of
+// published answers without touching the ring or the producers' line
+// in the common case.
+static inline int pop_ready(struct wqueue *wq)
+{
+    if (wq->pop_count == wq->cached_published) {
+        wq->cached_published = __atomic_load_n(&wq->published,
+                                               __ATOMIC_ACQUIRE);
+        if (wq->pop_count == wq->cached_published)
+            return 0;
+    }
+
+    return item_done(wq, wq->wed_pop, wq->queue_len);
+}
+
+// Folds the continuation entries of a chain into the item read from
+// its head, which already holds the input CRC of the whole chain. The
+// folded item can't describe the scattered dst segments, so it is
+// marked to have finish_items() skip its output CRC.
+static void read_chain(struct wqueue *wq, unsigned idx, unsigned n,
+                       struct wqueue_item *qitem, int hist,
+                       uint32_t pop_ticks)
+{
+    if (n > 1)
+        qitem->flags |= ITEM_CHAINED_FLAG;
+
+    for (unsigned i = 1; i < n; i++) {
+        struct wqueue_item seg;
+
+        idx = next_wed(wq, idx);
+        read_wed(wq, &wq->wed[idx], &seg, hist, pop_ticks);
+
+        qitem->src_len += seg.src_len;
+        qitem->dst_len += seg.dst_len;
+        qitem->flags |= seg.flags & WQ_DIRTY_FLAG;
+        qitem->end_time = seg.end_time;
+        if (!qitem->error_code)
+            qitem->error_code = seg.error_code;
+    }
+}
+
+static void wake_producers(struct wqueue *wq)
+{
+    if (!__atomic_load_n(&wq->push_waiters, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_lock(&wq->push_mutex);
+    pthread_cond_broadcast(&wq->push_condition);
+    pthread_mutex_unlock(&wq->push_mutex);
+}
+
+// Folds one sub-chunk of a wqueue_submit_large() buffer into its group.
+// Returns 1 and fills in qitem with the aggregate once the last
+// sub-chunk has been harvested.
+static int fold_group(struct wqueue_group *g, struct wqueue_item *qitem)
+{
+    if (g->harvested++ == 0) {
+        g->result.flags = qitem->flags;
+        g->result.start_time = qitem->start_time;
+        g->result.error_code = qitem->error_code;
+        g->result.src_crc = qitem->src_crc;
+    } else {
+        g->result.src_crc = crc32c_combine(g->result.src_crc,
+                                           qitem->src_crc, qitem->src_len);
+    }
+
+    g->result.dst_len += qitem->dst_len;
+    g->result.flags |= qitem->flags & WQ_DIRTY_FLAG;
+    g->result.end_time = qitem->end_time;
+    if (!g->result.error_code)
+        g->result.error_code = qitem->error_code;
+
+    if (g->harvested != g->chunks)
+        return 0;
+
+    *qitem = g->result;
+    free(g);
+
+    return 1;
+}
+
+// Must be called with pop_mutex held and the item at wed_pop done.
+// Returns the number of items handed back to the caller which may be
+// zero if only partial sub-chunks of a large submission were harvested.
+static size_t harvest(struct wqueue *wq, struct wqueue_item *qitems,
+                      size_t max)
+{
+    unsigned idx = wq->wed_pop;
+    size_t count = 0, entries = 0;
+    int hist = hist_on(wq);
+    uint32_t pop_ticks = hist ? host_to_ticks(wq, utils_monotonic_ns()) : 0;
+
+    do {
+        unsigned n = wq->wed[idx].chain_left + 1;
+        struct wqueue_group *g = wq->wed[idx].group;
+
+        read_wed(wq, &wq->wed[idx], &qitems[count], hist, pop_ticks);
+        read_chain(wq, idx, n, &qitems[count], hist, pop_ticks);
+
+        idx = wed_add(wq, idx, n);
+        entries += n;
+
+        if (g == NULL || fold_group(g, &qitems[count]))
+            count++;
+    } while (count < max && entries < wq->queue_len &&
+             item_done(wq, idx, wq->queue_len - entries));
 
     __sync_synchronize ();
 
-    wed[wed_pop].flags = 0;
+    for (size_t i = 0; i < entries; i++) {
+        wq->wed[wq->wed_pop].flags = 0;
+        wq->wed_pop = next_wed(wq, wq->wed_pop);
+    }
 
-    wed_pop = next_wed(wed_pop);
+    __atomic_store_n(&wq->pop_count, wq->pop_count + entries,
+                     __ATOMIC_SEQ_CST);
 
-    pthread_mutex_unlock(&pop_mutex);
+    wake_producers(wq);
 
-    pthread_mutex_lock(&push_mutex);
-    pthread_cond_signal(&push_condition);
-    pthread_mutex_unlock(&push_mutex);
+    return count;
+}
 
-    return ret;
+// Runs once pop_mutex has been dropped so the harvesters never hash
+// under the lock. The output is hashed here rather than as the item is
+// pushed as it only exists once the AFU is done.
+static void finish_items(struct wqueue *wq, struct wqueue_item *qitems,
+                         size_t count)
+{
+    int checksum = checksum_on(wq);
+
+    for (size_t i = 0; i < count; i++) {
+        int chained = qitems[i].flags & ITEM_CHAINED_FLAG;
+
+        qitems[i].flags &= ~ITEM_CHAINED_FLAG;
+        if (checksum && !chained)
+            qitems[i].dst_crc = crc32c(0, qitems[i].dst, qitems[i].dst_len);
+    }
+}
+
+int wqueue_pop(struct wqueue *wq, struct wqueue_item *qitem)
+{
+    if (wqueue_pop_batch(wq, qitem, 1) < 0)
+        return -1;
+
+    return qitem->error_code;
+}
+
+int wqueue_pop_batch(struct wqueue *wq, struct wqueue_item *qitems,
+                     size_t max)
+{
+    struct poller p;
+    struct timer_calib calib;
+    size_t count = 0;
+    uint64_t trace_start = trace_begin();
+
+    if (!max)
+        return 0;
+
+    int fresh = recalibrate(wq, &calib);
+
+    pthread_mutex_lock(&wq->pop_mutex);
+    if (fresh)
+        install_calib(wq, &calib);
+    poll_start(wq, &p);
+
+    while (!count) {
+        if (pop_ready(wq)) {
+            count = harvest(wq, qitems, max);
+            poll_start(wq, &p);
+            continue;
+        }
+
+        pthread_mutex_unlock(&wq->pop_mutex);
+        if (poll_wait(&p))
+            return -1;
+        pthread_mutex_lock(&wq->pop_mutex);
+    }
+
+    pthread_mutex_unlock(&wq->pop_mutex);
+
+    finish_items(wq, qitems, count);
+    trace_span("wq pop", trace_start, count);
+
+    return count;
+}
+
+int wqueue_try_pop(struct wqueue *wq, struct wqueue_item *qitem)
+{
+    struct timer_calib calib;
+    size_t count = 0;
+    int fresh = recalibrate(wq, &calib);
+
+    pthread_mutex_lock(&wq->pop_mutex);
+    if (fresh)
+        install_calib(wq, &calib);
+
+    while (!count && pop_ready(wq))
+        count = harvest(wq, qitem, 1);
+
+    pthread_mutex_unlock(&wq->pop_mutex);
+
+    if (!count) {
+        kick_owed(wq);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    finish_items(wq, qitem, count);
+
+    return qitem->error_code;
+}
+
+static void *event_thread(void *arg)
+{
+    struct wqueue *wq = arg;
+    uint64_t signalled = -1;
+    struct poller p;
+
+    pthread_mutex_lock(&wq->pop_mutex);
+    poll_start(wq, &p);
+    p.cfg.timeout_ms = 0;
+
+    while (!wq->event_stop) {
+        if (pop_ready(wq) && signalled != wq->pop_count) {
+            uint64_t one = 1;
+            if (write(wq->event_fd, &one, sizeof(one)) < 0 &&
+                errno != EAGAIN)
+                perror("signalling wqueue event_fd");
+
+            signalled = wq->pop_count;
+            poll_start(wq, &p);
+            p.cfg.timeout_ms = 0;
+        }
+
+        pthread_mutex_unlock(&wq->pop_mutex);
+        poll_wait(&p);
+        pthread_mutex_lock(&wq->pop_mutex);
+    }
+
+    pthread_mutex_unlock(&wq->pop_mutex);
+
+    return NULL;
+}
+
+// The returned eventfd becomes readable whenever completed items are
+// waiting. Read it to reset it and then drain the queue with
+// wqueue_try_pop() until it fails with EAGAIN. Real hardware has no
+// interrupts so a helper thread polls for completions using the
+// queue's poll policy; the emulator signals the eventfd directly.
+int wqueue_event_fd(struct wqueue *wq)
+{
+    pthread_mutex_lock(&wq->pop_mutex);
+
+    if (wq->event_fd >= 0)
+        goto out;
+
+    wq->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wq->event_fd < 0)
+        goto out;
+
+    if (cxl->set_event_fd) {
+        cxl->set_event_fd(wq->afu_h, wq->event_fd);
+        goto out;
+    }
+
+    wq->event_stop = 0;
+    int ret = pthread_create(&wq->event_thrd, NULL, event_thread, wq);
+    if (ret) {
+        close(wq->event_fd);
+        wq->event_fd = -1;
+        errno = ret;
+        goto out;
+    }
+
+    wq->event_thread_running = 1;
+
+out:
+    pthread_mutex_unlock(&wq->pop_mutex);
+    return wq->event_fd;
+}
+
+void wqueue_set_poll(struct wqueue *wq, const struct wqueue_poll *poll)
+{
+    pthread_mutex_lock(&wq->pop_mutex);
+    wq->poll = poll ? *poll : default_poll;
+    pthread_mutex_unlock(&wq->pop_mutex);
+}
+
+void wqueue_get_poll(struct wqueue *wq, struct wqueue_poll *poll)
+{
+    pthread_mutex_lock(&wq->pop_mutex);
+    *poll = wq->poll;
+    pthread_mutex_unlock(&wq->pop_mutex);
+}
+
+struct cxl_afu_h *wqueue_afu(struct wqueue *wq)
+{
+    return wq->afu_h;
 }
 
-struct cxl_afu_h *wqueue_afu(void)
+int wqueue_afu_node(struct wqueue *wq)
 {
-    return afu_h;
+    return wq->afu_node;
 }
 
-uint64_t wqueue_xor_sum(void)
+enum capi_backing wqueue_wed_backing(struct wqueue *wq)
 {
-    return xor_sum;
+    return wq->wed_mem.backing;
+}
+
+uint64_t wqueue_xor_sum(struct wqueue *wq)
+{
+    uint64_t ret = 0;
+
+    for (int i = 0; i < XOR_STRIPES; i++)
+        ret ^= __atomic_load_n(&wq->xor_sum[i].sum, __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+void wqueue_set_checksum(struct wqueue *wq, int enable)
+{
+    __atomic_store_n(&wq->checksum, enable, __ATOMIC_RELAXED);
 }
 
 double wqueue_calc_duration(struct wqueue_item *it)
@@ -224,7 +1347,50 @@ double wqueue_calc_duration(struct wqueue_item *it)
     return ((double)cycles) / CAPI_TIMER_FREQ;
 }
 
-void wqueue_set_croom(int croom)
+void wqueue_set_hist(struct wqueue *wq, int enable)
+{
+    __atomic_store_n(&wq->hist_enabled, enable, __ATOMIC_RELAXED);
+}
+
+struct hist *wqueue_hist(struct wqueue *wq, enum wqueue_hist_type type)
+{
+    return wq->hist[type];
+}
+
+void wqueue_hist_dump(struct wqueue *wq, FILE *out)
+{
+    static const char *names[] = {
+        [WQ_HIST_SERVICE] = "service",
+        [WQ_HIST_QUEUE] = "queue",
+        [WQ_HIST_PICKUP] = "pickup",
+    };
+
+    fprintf(out, "Wqueue latencies (ns):\n");
+    for (int i = 0; i < WQ_HIST_TYPES; i++)
+        hist_dump(wq->hist[i], out, names[i]);
+}
+
+void wqueue_set_doorbell(struct wqueue *wq, enum wqueue_doorbell mode)
+{
+    __atomic_store_n(&wq->doorbell, mode, __ATOMIC_RELAXED);
+    kick_owed(wq);
+}
+
+void wqueue_doorbell_stats(struct wqueue *wq, uint64_t *rung,
+                           uint64_t *elided)
+{
+    *rung = __atomic_load_n(&wq->doorbells_rung, __ATOMIC_RELAXED);
+    *elided = __atomic_load_n(&wq->doorbells_elided, __ATOMIC_RELAXED);
+}
+
+void wqueue_counters(struct wqueue *wq, uint32_t *read_count,
+                     uint32_t *write_count)
+{
+    cxl->mmio_read32(wq->afu_h, &wq->mmio->read_count, read_count);
+    cxl->mmio_read32(wq->afu_h, &wq->mmio->write_count, write_count);
+}
+
+void wqueue_set_croom(struct wqueue *wq, int croom)
 {
-    cxl->mmio_write64(afu_h, &mmio->croom, croom);
+    cxl->mmio_write64(wq->afu_h, &wq->mmio->croom, croom);
 }
@@ -34,9 +34,11 @@
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 
 int wrap_mmio_write64(struct cxl_afu_h *afu, void *offset, uint64_t data) {
@@ -78,6 +80,11 @@ struct cxl_afu_h {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     int item_count;
+    int event_fd;
+    uint32_t read_lines, write_lines;
+    uint64_t croom;
+    int waiting;
+    uint64_t triggers, redundant_triggers;
 };
 
 static uint64_t get_timer(void)
@@ -85,11 +92,8 @@ static uint64_t get_timer(void)
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    double seconds = tv.tv_usec;
-    seconds *= 1e-6;
-    seconds += tv.tv_sec;
-
-    return seconds * CAPI_TIMER_FREQ;
+    return (uint64_t) tv.tv_sec * CAPI_TIMER_FREQ +
+        (uint64_t) tv.tv_usec * (CAPI_TIMER_FREQ / 1000000);
 }
 
 static void *afu_thread(void *arg)
@@ -107,7 +111,9 @@ static void *afu_thread(void *arg)
         while (!(afu->wed[idx].flags & WQ_READY_FLAG) ||
                afu->wed[idx].flags & WQ_DONE_FLAG)
         {
+            afu->waiting = 1;
             pthread_cond_wait(&afu->cond, &afu->mutex);
+            afu->waiting = 0;
             if (afu->stop) {
                 pthread_mutex_unlock(&afu->mutex);
                 goto end_thread;
@@ -120,7 +126,7 @@ static void *afu_thread(void *arg)
 
         int dirty = 0;
         int error_code;
-        size_t dst_len;
+        size_t dst_len = 0;
 
         if ((afu->wed[idx].src != NULL || (afu->wed[idx].flags & WQ_WRITE_ONLY_FLAG))
             && afu->wed[idx].dst != NULL)
@@ -137,6 +143,15 @@ static void *afu_thread(void *arg)
         }
 
         afu->wed[idx].error_code = error_code;
+
+        // Mirror the hardware's cache line counters
+        if (!(afu->wed[idx].flags & WQ_WRITE_ONLY_FLAG))
+            __atomic_add_fetch(&afu->read_lines, afu->wed[idx].chunk_length,
+                               __ATOMIC_RELAXED);
+        if (dirty || (afu->wed[idx].flags & WQ_ALWAYS_WRITE_FLAG))
+            __atomic_add_fetch(&afu->write_lines,
+                               (dst_len + CAPI_CACHELINE_BYTES - 1) /
+                               CAPI_CACHELINE_BYTES, __ATOMIC_RELAXED);
         afu->wed[idx].chunk_length = (dst_len+CAPI_CACHELINE_BYTES-1) /
             CAPI_CACHELINE_BYTES;
 
@@ -151,8 +166,19 @@ static void *afu_thread(void *arg)
         __sync_synchronize ();
         afu->wed[idx].flags = flags;
 
+        // Order the done flag before reading the next entry: the host
+        // skips the trigger if it sees this entry still in progress
+        __sync_synchronize ();
+
         afu->item_count++;
 
+        int event_fd = __atomic_load_n(&afu->event_fd, __ATOMIC_ACQUIRE);
+        if (event_fd >= 0) {
+            uint64_t one = 1;
+            if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                perror("signalling emulated event_fd");
+        }
+
         idx++;
         if (idx == afu->queue_len)
             idx = 0;
@@ -171,6 +197,11 @@ struct cxl_afu_h *emul_afu_open_dev(char *path)
     afu->stop = -1;
     afu->mmio = (void*)-1;
     afu->item_count = 0;
+    afu->event_fd = -1;
+    afu->read_lines = afu->write_lines = 0;
+    afu->croom = 0;
+    afu->waiting = 0;
+    afu->triggers = afu->redundant_triggers = 0;
 
     if (pthread_mutex_init(&afu->mutex, NULL))
         goto error_free_out;
@@ -226,6 +257,9 @@ int emul_mmio_write64(struct cxl_afu_h *afu, void *offset, uint64_t data)
         afu->queue_len = data + 1;
     } else if (offset == &afu->mmio->trigger) {
         pthread_mutex_lock(&afu->mutex);
+        afu->triggers++;
+        if (!afu->waiting)
+            afu->redundant_triggers++;
         pthread_cond_signal(&afu->cond);
         pthread_mutex_unlock(&afu->mutex);
     } else if (offset == &afu->mmio->force_stop) {
@@ -233,6 +267,8 @@ int emul_mmio_write64(struct cxl_afu_h *afu, void *offset, uint64_t data)
         afu->stop = 1;
         pthread_cond_signal(&afu->cond);
         pthread_mutex_unlock(&afu->mutex);
+    } else if (offset == &afu->mmio->croom) {
+        afu->croom = data;
     }
 
     return 0;
@@ -259,7 +295,13 @@ int emul_mmio_read64(struct cxl_afu_h *afu, void *offset, uint64_t *data)
     } else if (offsetp == &afu->mmio->debug) {
         *data = afu->item_count;
     } else if (offsetp == &afu->mmio->read_count) {
-        *data = 0;
+        *data = __atomic_load_n(&afu->read_lines, __ATOMIC_RELAXED) |
+            (uint64_t) __atomic_load_n(&afu->write_lines,
+                                       __ATOMIC_RELAXED) << 32;
+    } else if (offsetp == &afu->mmio->croom) {
+        *data = afu->croom;
+    } else if (offsetp == &afu->mmio->timer) {
+        *data = get_timer();
     }
 
     return 0;
@@ -327,6 +369,11 @@ int proc_run(struct proc *proc, int flags, const void *src, void *dst,
     return 0;
 }
 
+static void emul_set_event_fd(struct cxl_afu_h *afu, int fd)
+{
+    __atomic_store_n(&afu->event_fd, fd, __ATOMIC_RELEASE);
+}
+
 static const struct cxl cxl_emul = {
     .afu_open_dev = emul_afu_open_dev,
     .afu_free = emul_afu_free,
@@ -336,9 +383,19 @@ static const struct cxl cxl_emul = {
     .mmio_write32 = emul_mmio_write32,
     .mmio_read64 = emul_mmio_read64,
     .mmio_read32 = emul_mmio_read32,
+    .set_event_fd = emul_set_event_fd,
 };
 
 void wqueue_emul_init(void)
 {
     cxl = &cxl_emul;
 }
+
+void wqueue_emul_trigger_stats(struct cxl_afu_h *afu, uint64_t *triggers,
+                               uint64_t *redundant)
+{
+    pthread_mutex_lock(&afu->mutex);
+    *triggers = afu->triggers;
+    *redundant = afu->redundant_triggers;
+    pthread_mutex_unlock(&afu->mutex);
+}
@@ -0,0 +1,226 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Stream a file through an AFU work queue and write the result
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "pipeline.h"
+#include "wqueue.h"
+#include "wqueue_emul.h"
+#include "capi.h"
+#include "croom_tuner.h"
+#include "trace.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+static struct wqueue_mmio emul_mmio;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [OPTIONS] INPUT [OUTPUT]\n\n"
+            "  -e          use the software emulator instead of an AFU\n"
+            "  -d DEV      CXL device (default /dev/cxl/afu0.0d)\n"
+            "  -m OFFSET   wqueue MMIO offset on the device (default 0)\n"
+            "  -q LEN      work queue length (default 256)\n"
+            "  -c BYTES    chunk size (default 1M)\n"
+            "  -i COUNT    maximum chunks in flight (default 64)\n"
+            "  -P          back the WED ring and buffers with hugepages\n"
+            "  -N NODE     run threads and place buffers on a NUMA node,\n"
+            "              'afu' for the node the card is attached to\n"
+            "  -T          auto-tune croom while streaming\n"
+            "  -t FILE     write a Chrome trace of the run to FILE\n"
+            "  -W          keep waiting if the AFU stops responding\n"
+            "  -r N        reader threads\n"
+            "  -s N        submitter threads\n"
+            "  -H N        harvester threads\n"
+            "  -w N        writer threads\n\n"
+            "INPUT and OUTPUT may be - for stdin and stdout. Without OUTPUT\n"
+            "the results are discarded.\n", prog);
+}
+
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t ret = strtoul(s, &end, 0);
+
+    switch (*end) {
+    case 'k': case 'K': ret <<= 10; break;
+    case 'm': case 'M': ret <<= 20; break;
+    case 'g': case 'G': ret <<= 30; break;
+    }
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pipeline_opts opts;
+    char *dev = "/dev/cxl/afu0.0d";
+    unsigned long mmio_offset = 0;
+    struct wqueue_opts wq_opts = {
+        .queue_len = 256,
+        .wed_backing = CAPI_BACKING_NORMAL,
+    };
+    const char *node = NULL;
+    int emulate = 0;
+    int tune = 0;
+    const char *trace_path = NULL;
+    int ret = 1;
+    int c;
+
+    pipeline_default_opts(&opts);
+
+    while ((c = getopt(argc, argv, "ed:m:q:c:i:PN:Tt:Wr:s:H:w:h")) != -1) {
+        switch (c) {
+        case 'e': emulate = 1; break;
+        case 'd': dev = optarg; break;
+        case 'm': mmio_offset = strtoul(optarg, NULL, 0); break;
+        case 'q': wq_opts.queue_len = strtoul(optarg, NULL, 0); break;
+        case 'c': opts.chunk_size = parse_size(optarg); break;
+        case 'i': opts.max_inflight = strtoul(optarg, NULL, 0); break;
+        case 'P':
+            wq_opts.wed_backing = CAPI_BACKING_HUGE_2M;
+            opts.backing = CAPI_BACKING_HUGE_1G;
+            break;
+        case 'N': node = optarg; break;
+        case 'T': tune = 1; break;
+        case 't': trace_path = optarg; break;
+        case 'W': opts.wait_forever = 1; break;
+        case 'r': opts.readers = atoi(optarg); break;
+        case 's': opts.submitters = atoi(optarg); break;
+        case 'H': opts.harvesters = atoi(optarg); break;
+        case 'w': opts.writers = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc || argc - optind > 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *in_path = argv[optind];
+    const char *out_path = argc - optind > 1 ? argv[optind + 1] : NULL;
+
+    int in_fd = STDIN_FILENO;
+    if (strcmp(in_path, "-") && (in_fd = open(in_path, O_RDONLY)) < 0) {
+        fprintf(stderr, "Unable to open '%s': %s\n", in_path,
+                strerror(errno));
+        return 1;
+    }
+
+    int out_fd = -1;
+    if (out_path == NULL)
+        ;
+    else if (!strcmp(out_path, "-"))
+        out_fd = STDOUT_FILENO;
+    else if ((out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC,
+                            0666)) < 0)
+    {
+        fprintf(stderr, "Unable to open '%s': %s\n", out_path,
+                strerror(errno));
+        goto close_in;
+    }
+
+    struct wqueue_mmio *mmio = (struct wqueue_mmio *) mmio_offset;
+    if (emulate) {
+        wqueue_emul_init();
+        dev = "emul";
+        mmio = &emul_mmio;
+    }
+
+    struct wqueue *wq = wqueue_init_opts(dev, mmio, &wq_opts);
+    if (wq == NULL) {
+        fprintf(stderr, "Unable to open work queue on '%s': %s\n", dev,
+                strerror(errno));
+        goto close_out;
+    }
+
+    if (node && !strcmp(node, "afu")) {
+        opts.node = wqueue_afu_node(wq);
+        if (opts.node < 0)
+            fprintf(stderr, "NUMA node of '%s' unknown, not placing "
+                    "threads\n", dev);
+    } else if (node) {
+        opts.node = atoi(node);
+    }
+
+    struct pipeline *p = pipeline_new(wq, in_fd, out_fd, &opts);
+    if (p == NULL) {
+        fprintf(stderr, "Unable to create pipeline: %s\n", strerror(errno));
+        goto cleanup_wq;
+    }
+
+    fprintf(stderr, "WED ring on %s\n",
+            capi_backing_name(wqueue_wed_backing(wq)));
+
+    struct croom_tuner *tuner = NULL;
+    if (tune) {
+        struct croom_tuner_opts tune_opts;
+        croom_tuner_default_opts(&tune_opts);
+
+        tuner = croom_tuner_start(wq, &tune_opts);
+        if (tuner == NULL)
+            perror("starting croom tuner");
+    }
+
+    if (trace_path)
+        trace_enable(1);
+
+    ret = pipeline_run(p) ? 1 : 0;
+
+    if (trace_path) {
+        trace_enable(0);
+
+        FILE *tf = fopen(trace_path, "w");
+        if (tf == NULL || trace_dump(tf))
+            fprintf(stderr, "Unable to write trace '%s': %s\n", trace_path,
+                    strerror(errno));
+        if (tf != NULL)
+            fclose(tf);
+    }
+    pipeline_print_stats(p, stderr);
+
+    if (tuner != NULL) {
+        croom_tuner_print(tuner, stderr);
+        croom_tuner_stop(tuner);
+    }
+    pipeline_free(p);
+
+cleanup_wq:
+    wqueue_cleanup(wq);
+close_out:
+    if (out_fd > STDOUT_FILENO)
+        close(out_fd);
+close_in:
+    if (in_fd != STDIN_FILENO)
+        close(in_fd);
+
+    return ret;
+}
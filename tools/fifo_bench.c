@@ -0,0 +1,230 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Fifo throughput benchmark
+//
+//     Pushes tokens through each kind of fifo with the given number of
+//     producer and consumer threads and reports ns/item along with how
+//     often each side had to wait. The SPSC fifo is only run with one
+//     thread on each side. The lock-free fifos spin before sleeping
+//     only when there is more than one CPU, so run this on a multi-core
+//     machine for numbers that reflect the fast path; -a pins the
+//     producers and consumers to separate CPUs.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "fifo.h"
+#include "worker.h"
+#include "utils.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static struct {
+    struct worker producers;
+    struct worker consumers;
+    struct fifo *f;
+    size_t count;
+    size_t batch;
+    int pin;
+    uint64_t popped;
+} bench;
+
+static void *producer(void *arg)
+{
+    size_t share = bench.count / bench.producers.num_threads;
+    void *items[bench.batch];
+
+    for (size_t i = 0; i < share; i += bench.batch) {
+        size_t n = share - i < bench.batch ? share - i : bench.batch;
+
+        for (size_t j = 0; j < n; j++)
+            items[j] = (void *) (uintptr_t) (i + j + 1);
+
+        if (n == 1)
+            fifo_push(bench.f, items[0]);
+        else
+            fifo_push_n(bench.f, items, n);
+    }
+
+    fifo_close(bench.f);
+    worker_finish_thread(&bench.producers);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    void *items[bench.batch];
+    uint64_t popped = 0;
+    size_t n;
+
+    if (bench.batch == 1) {
+        while (fifo_pop(bench.f) != NULL)
+            popped++;
+    } else {
+        while ((n = fifo_pop_n(bench.f, items, bench.batch)) != 0)
+            popped += n;
+    }
+
+    __atomic_add_fetch(&bench.popped, popped, __ATOMIC_RELAXED);
+    worker_finish_thread(&bench.consumers);
+    return NULL;
+}
+
+// Producers get the first CPUs and consumers the ones after them
+static int start_side(struct worker *w, int threads, int first_cpu,
+                      void *(*fn)(void *))
+{
+    cpu_set_t cpus;
+
+    if (!bench.pin)
+        return worker_start(w, threads, fn);
+
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < threads; i++)
+        CPU_SET(first_cpu + i, &cpus);
+
+    return worker_start_cpus(w, threads, fn, &cpus);
+}
+
+static int run(const char *name, struct fifo *f, int producers,
+               int consumers)
+{
+    if (f == NULL) {
+        perror(name);
+        return -1;
+    }
+
+    bench.f = f;
+    bench.popped = 0;
+
+    for (int i = 0; i < producers; i++)
+        fifo_open(f);
+
+    uint64_t start = utils_monotonic_ns();
+
+    if (start_side(&bench.consumers, consumers, producers, consumer)) {
+        perror("starting consumers");
+        goto free_fifo;
+    }
+
+    if (start_side(&bench.producers, producers, 0, producer)) {
+        perror("starting producers");
+        for (int i = 0; i < producers; i++)
+            fifo_close(f);
+        worker_join(&bench.consumers);
+        worker_free(&bench.consumers);
+        goto free_fifo;
+    }
+
+    worker_join(&bench.producers);
+    worker_join(&bench.consumers);
+
+    double secs = (utils_monotonic_ns() - start) / 1e9;
+
+    struct fifo_stats st;
+    fifo_stats(f, &st);
+
+    printf("%-8s  %12.0f  %10.1f  %10llu  %10llu\n", name,
+           bench.count / secs, secs * 1e9 / bench.count,
+           (unsigned long long) st.full_waits,
+           (unsigned long long) st.empty_waits);
+
+    worker_free(&bench.producers);
+    worker_free(&bench.consumers);
+    fifo_free(f);
+
+    if (bench.popped != bench.count) {
+        fprintf(stderr, "%s: pushed %zu items but popped %llu\n", name,
+                bench.count, (unsigned long long) bench.popped);
+        return -1;
+    }
+
+    return 0;
+
+free_fifo:
+    fifo_free(f);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-q ENTRIES] [-n ITEMS] [-b BATCH] "
+            "[-p PRODUCERS] [-c CONSUMERS] [-a]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t entries = 256;
+    size_t count = 1000000;
+    int producers = 1;
+    int consumers = 1;
+    int c;
+
+    bench.batch = 1;
+
+    while ((c = getopt(argc, argv, "q:n:b:p:c:ah")) != -1) {
+        switch (c) {
+        case 'q': entries = strtoul(optarg, NULL, 0); break;
+        case 'n': count = strtoul(optarg, NULL, 0); break;
+        case 'b': bench.batch = strtoul(optarg, NULL, 0); break;
+        case 'p': producers = atoi(optarg); break;
+        case 'c': consumers = atoi(optarg); break;
+        case 'a': bench.pin = 1; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (entries < 2 || !bench.batch || producers < 1 || consumers < 1 ||
+        count < producers)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (bench.pin && producers + consumers > cpus) {
+        fprintf(stderr, "Pinning %d producers and %d consumers needs as "
+                "many CPUs\n", producers, consumers);
+        return 1;
+    }
+
+    bench.count = count / producers * producers;
+
+    printf("%zu entries, %zu items in batches of %zu, %d producers, "
+           "%d consumers%s, %ld CPUs\n\n", entries, bench.count,
+           bench.batch, producers, consumers,
+           bench.pin ? " on separate CPUs" : "", cpus);
+    printf("fifo           items/s     ns/item  full waits  empty waits\n");
+
+    int ret = run("locked", fifo_new(entries), producers, consumers);
+
+    if (producers == 1 && consumers == 1)
+        ret |= run("spsc", fifo_spsc_new(entries), producers, consumers);
+
+    ret |= run("mpmc", fifo_mpmc_new(entries), producers, consumers);
+
+    return ret ? 1 : 0;
+}
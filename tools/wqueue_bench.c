@@ -0,0 +1,311 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Wqueue submission benchmark run against the software emulator
+//
+//     With several producer and consumer threads this also shows how
+//     much cache line traffic the queue's own bookkeeping causes: the
+//     hardware cache-miss counter is sampled around each run where
+//     perf events are available.
+//
+//     Cache lines bouncing between the producer and consumer sides only
+//     cost anything when the two run on different cores, so -a pins the
+//     producers and the consumers to separate CPUs. Comparing ns/item
+//     against a build configured with --wqueue-split, which gives the
+//     two sides' state cache lines of their own, shows what the
+//     separation is worth. To see the contended lines themselves on
+//     x86, run
+//
+//       perf c2c record -- build/wqueue-bench -a -p 1 -c 1
+//       perf c2c report --stdio
+//
+//     and look for struct wqueue among the lines with shared HITMs.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "wqueue.h"
+#include "wqueue_emul.h"
+#include "worker.h"
+#include "capi.h"
+#include "utils.h"
+
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+static struct wqueue_mmio mmio;
+
+static struct {
+    struct worker producers;
+    struct worker consumers;
+    struct wqueue *wq;
+    size_t count;
+    size_t batch;
+    int pin;
+    void *buf;
+    size_t buf_len;
+    int errors;
+} bench;
+
+static void *producer(void *arg)
+{
+    struct wqueue_item items[bench.batch];
+    size_t share = bench.count / bench.producers.num_threads;
+
+    for (size_t i = 0; i < bench.batch; i++) {
+        memset(&items[i], 0, sizeof(items[i]));
+        items[i].src = bench.buf;
+        items[i].dst = bench.buf;
+        items[i].src_len = bench.buf_len;
+    }
+
+    for (size_t i = 0; i < share; i += bench.batch) {
+        size_t n = share - i < bench.batch ? share - i : bench.batch;
+        wqueue_push_batch(bench.wq, items, n);
+    }
+
+    worker_finish_thread(&bench.producers);
+    return NULL;
+}
+
+// Each consumer stops at the first end marker it sees and puts back any
+// extra ones it took so the others get theirs
+static void *consumer(void *arg)
+{
+    struct wqueue_item items[bench.batch];
+    int markers = 0;
+
+    while (!markers) {
+        int n = wqueue_pop_batch(bench.wq, items, bench.batch);
+        if (n < 0) {
+            __atomic_add_fetch(&bench.errors, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+            if (items[i].flags & WQ_LAST_ITEM_FLAG)
+                markers++;
+    }
+
+    for (int i = 1; i < markers; i++) {
+        struct wqueue_item last = {
+            .flags = WQ_LAST_ITEM_FLAG,
+            .src = bench.buf,
+            .dst = bench.buf,
+            .src_len = CAPI_CACHELINE_BYTES,
+        };
+        wqueue_push(bench.wq, &last);
+    }
+
+    worker_finish_thread(&bench.consumers);
+    return NULL;
+}
+
+// Counts cache misses in this process and every thread it starts from
+// here on. Returns -1 where perf events aren't available.
+static int open_miss_counter(void)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+        .inherit = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Producers get the first CPUs and consumers the ones after them
+static int start_side(struct worker *w, int threads, int first_cpu,
+                      void *(*fn)(void *))
+{
+    cpu_set_t cpus;
+
+    if (!bench.pin)
+        return worker_start(w, threads, fn);
+
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < threads; i++)
+        CPU_SET(first_cpu + i, &cpus);
+
+    return worker_start_cpus(w, threads, fn, &cpus);
+}
+
+static int run(size_t queue_len, size_t count, size_t batch,
+               int producers, int consumers)
+{
+    int miss_fd = open_miss_counter();
+
+    bench.wq = wqueue_init("emul", &mmio, queue_len);
+    if (bench.wq == NULL)
+        goto close_miss_fd;
+
+    bench.count = count / producers * producers;
+    bench.batch = batch;
+    bench.errors = 0;
+
+    uint64_t start = utils_monotonic_ns();
+
+    if (start_side(&bench.consumers, consumers, producers, consumer)) {
+        perror("starting consumers");
+        goto cleanup_wq;
+    }
+
+    if (start_side(&bench.producers, producers, 0, producer)) {
+        perror("starting producers");
+        abort();
+    }
+
+    worker_join(&bench.producers);
+
+    for (int i = 0; i < consumers; i++) {
+        struct wqueue_item last = {
+            .flags = WQ_LAST_ITEM_FLAG,
+            .src = bench.buf,
+            .dst = bench.buf,
+            .src_len = CAPI_CACHELINE_BYTES,
+        };
+        wqueue_push(bench.wq, &last);
+    }
+
+    worker_join(&bench.consumers);
+
+    double secs = (utils_monotonic_ns() - start) / 1e9;
+
+    uint64_t rung, elided, triggers, redundant;
+    wqueue_doorbell_stats(bench.wq, &rung, &elided);
+    wqueue_emul_trigger_stats(wqueue_afu(bench.wq), &triggers, &redundant);
+
+    printf("  %6zu  %12.0f  %10.1f  %10llu  %10llu  %10llu", batch,
+           bench.count / secs, secs * 1e9 / bench.count,
+           (unsigned long long) rung, (unsigned long long) elided,
+           (unsigned long long) redundant);
+
+    uint64_t misses;
+    if (miss_fd >= 0 && read(miss_fd, &misses, sizeof(misses)) ==
+        sizeof(misses))
+        printf("  %10.2f\n", (double) misses / bench.count);
+    else
+        printf("  %10s\n", "n/a");
+
+    worker_free(&bench.producers);
+    worker_free(&bench.consumers);
+    wqueue_cleanup(bench.wq);
+    if (miss_fd >= 0)
+        close(miss_fd);
+
+    return bench.errors ? -1 : 0;
+
+cleanup_wq:
+    wqueue_cleanup(bench.wq);
+close_miss_fd:
+    if (miss_fd >= 0)
+        close(miss_fd);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-q QUEUE_LEN] [-n ITEMS] [-s ITEM_BYTES] "
+            "[-b MAX_BATCH] [-p PRODUCERS] [-c CONSUMERS] [-a]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t queue_len = 256;
+    size_t count = 200000;
+    size_t item_len = CAPI_CACHELINE_BYTES;
+    size_t max_batch = 128;
+    int producers = 1;
+    int consumers = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "q:n:s:b:p:c:ah")) != -1) {
+        switch (c) {
+        case 'q': queue_len = strtoul(optarg, NULL, 0); break;
+        case 'n': count = strtoul(optarg, NULL, 0); break;
+        case 's': item_len = strtoul(optarg, NULL, 0); break;
+        case 'b': max_batch = strtoul(optarg, NULL, 0); break;
+        case 'p': producers = atoi(optarg); break;
+        case 'c': consumers = atoi(optarg); break;
+        case 'a': bench.pin = 1; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (queue_len < 2 || !max_batch || producers < 1 || consumers < 1 ||
+        count < producers)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (bench.pin && producers + consumers > sysconf(_SC_NPROCESSORS_ONLN)) {
+        fprintf(stderr, "Pinning %d producers and %d consumers needs as "
+                "many CPUs\n", producers, consumers);
+        return 1;
+    }
+
+    item_len = (item_len + CAPI_CACHELINE_BYTES - 1) &
+        ~(CAPI_CACHELINE_BYTES - 1);
+
+    bench.buf = capi_alloc(item_len);
+    if (bench.buf == NULL) {
+        perror("allocating buffer");
+        return 1;
+    }
+    memset(bench.buf, 0xAA, item_len);
+    bench.buf_len = item_len;
+
+    wqueue_emul_init();
+
+#ifdef WQUEUE_SPLIT_LAYOUT
+    const char *layout = "split";
+#else
+    const char *layout = "packed";
+#endif
+
+    printf("Queue length %zu, %zu items of %zu bytes, %d producers, "
+           "%d consumers%s, %s layout\n\n", queue_len, count, item_len,
+           producers, consumers, bench.pin ? " on separate CPUs" : "",
+           layout);
+    printf("   batch       items/s     ns/item    triggers      elided"
+           "   redundant  misses/item\n");
+
+    int ret = 0;
+    for (size_t batch = 1; batch <= max_batch; batch *= 2) {
+        if (run(queue_len, count, batch, producers, consumers)) {
+            fprintf(stderr, "Benchmark failed at batch size %zu\n", batch);
+            ret = 1;
+            break;
+        }
+    }
+
+    free(bench.buf);
+    return ret;
+}
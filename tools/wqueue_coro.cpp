@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2015 PMC-Sierra, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at
+// http://www.apache.org/licenses/LICENSE-2.0 Unless required by
+// applicable law or agreed to in writing, software distributed under the
+// License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+// CONDITIONS OF ANY KIND, either express or implied. See the License for
+// the specific language governing permissions and limitations under the
+// License.
+//
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Copy buffers through the software emulator with the C++
+//     coroutine front end
+//
+//     Several coroutines each submit a run of copies and check every
+//     result, while an item pushed straight through the C interface
+//     shares the same wqueue and has to come back through the foreign
+//     handler. Built whenever a C++20 compiler is available, so it
+//     also keeps wqueue.hpp compiling as wqueue.h changes.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "wqueue.hpp"
+#include "wqueue_emul.h"
+#include "capi.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const int COROUTINES = 8;
+static const int COPIES = 64;
+static const std::size_t BUF_BYTES = 4 * CAPI_CACHELINE_BYTES;
+
+static struct wqueue_mmio mmio;
+static int errors;
+static int finished;
+
+static capi::detached_task copier(capi::queue &q, char *src, char *dst)
+{
+    for (int i = 0; i < COPIES; i++) {
+        std::memset(src, i, BUF_BYTES);
+        std::memset(dst, 0, BUF_BYTES);
+
+        wqueue_item item = {};
+        item.src = src;
+        item.dst = dst;
+        item.src_len = BUF_BYTES;
+        item.flags = WQ_ALWAYS_WRITE_FLAG;
+        item.opaque = src;
+
+        wqueue_item done = co_await q.submit(item);
+
+        if (done.error_code || done.opaque != src ||
+            std::memcmp(src, dst, BUF_BYTES))
+            errors++;
+    }
+
+    finished++;
+}
+
+int main()
+{
+    wqueue_emul_init();
+
+    char dev[] = "emul";
+    struct wqueue *wq = wqueue_init(dev, &mmio, 32);
+    if (wq == NULL) {
+        std::perror("wqueue_init");
+        return 1;
+    }
+
+    std::vector<char *> bufs;
+    for (int i = 0; i < 2 * COROUTINES + 2; i++) {
+        char *b = static_cast<char *>(capi_alloc(BUF_BYTES));
+        if (b == NULL) {
+            std::perror("capi_alloc");
+            return 1;
+        }
+        bufs.push_back(b);
+    }
+
+    capi::queue q(wq);
+    int foreign = 0;
+    q.set_foreign_handler([&](const wqueue_item &) { foreign++; });
+
+    wqueue_item raw = {};
+    raw.src = bufs[2 * COROUTINES];
+    raw.dst = bufs[2 * COROUTINES + 1];
+    raw.src_len = BUF_BYTES;
+    raw.opaque = &raw;
+    wqueue_push(wq, &raw);
+
+    for (int i = 0; i < COROUTINES; i++)
+        copier(q, bufs[2 * i], bufs[2 * i + 1]);
+
+    q.run();
+
+    while (!foreign) {
+        if (!q.poll())
+            q.wait(10);
+    }
+
+    std::printf("%d coroutines, %d copies each: %d errors, "
+                "%d foreign completion\n", finished, COPIES, errors, foreign);
+
+    for (char *b : bufs)
+        std::free(b);
+    wqueue_cleanup(wq);
+
+    return errors || finished != COROUTINES ? 1 : 0;
+}